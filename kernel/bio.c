@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,17 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To start reading a block that will be wanted soon,
+//     without waiting for it, call breadahead.
+// * To overlap many reads or writes, start them with
+//     bread_async or bwrite_async, then call bwait on each
+//     buffer before using or releasing it.
+// * Where latency matters more than CPU time, call
+//     bwaitpoll instead of bwait.
+// * To overwrite a whole block without reading it first,
+//     call bclaim instead of bread.
+// * To write a buffer's contents to some other block,
+//     call bwrite_to.
 
 
 #include "types.h"
@@ -22,68 +33,549 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "file.h"
+#include "memlayout.h"
+
+// Cached blocks are found through a hash table keyed by
+// (dev, blockno).  Each bucket has its own lock, so lookups
+// and releases of different blocks can proceed in parallel.
+// A bucket lock protects the hash chain and the refcnt and
+// accessed fields of the buffers on it.
+//
+// Choosing a buffer to recycle is separate from lookup.
+// bcache.lock protects the replacement queues, and serializes
+// recycling so that a block can only be cached once.  Lock
+// order is bcache.lock, then a bucket lock.
+//
+// Replacement follows 2Q, so that one scan through a big file
+// cannot flush the inode, bitmap and directory blocks everyone
+// else needs.  A newly cached block goes on the A1in queue,
+// which is FIFO; using it again while it is there does not
+// count, since a scan touches a block several times in quick
+// succession.  A block evicted from A1in is remembered in the
+// ghost table A1out.  If it is wanted again while remembered,
+// it has proven to be more than a one-time scan and is cached
+// on the Am queue, which is managed by the clock algorithm:
+// an accessed buffer gets a second chance.  Pinned buffers
+// (such as the log's) have a non-zero refcnt and are never
+// recycled.  Hits only set b->accessed, so they need no more
+// than the bucket lock.
+//
+// The cache is sized from free physical memory.  It starts
+// with NBUF buffers and grows a chunk at a time on misses,
+// up to BCACHEPCT percent of the memory free at boot.  When
+// kalloc() runs out of pages it calls breclaim(), which gives
+// back a chunk of unused buffers.  Since kalloc() may be
+// called with a p->lock held, bcache.lock and the bucket locks
+// are never held while sleeping or calling wakeup().
+//
+// Buffers hold bsize bytes, the block size of the mounted file
+// systems.  The cache starts out with blocks of MINBSIZE, and
+// fsinit() calls bsetsize() once it has read the root file
+// system's super block, which replaces the buffers with ones of
+// the right size.
+//
+// Disk I/O is started by bstart(), which hands it to the I/O
+// scheduler, and finished by the driver calling iodone(),
+// which calls bdone(), usually from an interrupt.  bcache.iolock
+// protects b->disk, which is set while the I/O is in flight.
+
+#define NBUCKET 2053
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// Size of the A1out ghost table, a direct-mapped table
+// of (dev, blockno) keys of blocks evicted from A1in.
+#define NGHOST  8192
+#define GHOSTKEY(dev, blockno) (((uint64)(dev) << 32) | (blockno))
+
+// Buffer queues.
+#define BQ_FREE  0  // holding no block
+#define BQ_A1IN  1  // cached once, FIFO
+#define BQ_AM    2  // cached again after eviction from A1in, clock
+#define NBQ      3
+
+// A chunk is a page of buf headers.  Each page of
+// block data holds BPP of the chunk's buffers; a chunk
+// holds a whole number of pages for any block size.
+#define BPP       (PGSIZE / bsize)
+#define MAXBPP    (PGSIZE / MINBSIZE)
+#define CHUNKBUF  ((PGSIZE - sizeof(void*)) / sizeof(struct buf) / MAXBPP * MAXBPP)
+
+uint bsize = MINBSIZE;
+
+struct bchunk {
+  struct bchunk *next;
+  struct buf buf[CHUNKBUF];
+};
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;  // hash chain, through hnext
+};
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct spinlock iolock;
+  struct bchunk *chunks;
+  int nbuf;      // number of buffers
+  int maxbuf;    // grow no larger than this
+  uint64 minfree; // don't grow if fewer free pages than this
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // Queues of buffers, through prev/next.  Buffers are
+  // added at q[i].next and taken from q[i].prev.
+  struct buf q[NBQ];
+  int qlen[NBQ];
+
+  uint64 ghost[NGHOST];
+
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static int bgrow(void);
+static int bdrain(struct bchunk *c);
+
+// Size the cache from free physical memory.
+static void
+blimit(void)
+{
+  uint64 n;
+
+  // Each chunk costs a page of headers plus CHUNKBUF/BPP
+  // pages of data.
+  n = kfreepages();
+  bcache.maxbuf = n * BCACHEPCT / 100 / (1 + CHUNKBUF/BPP) * CHUNKBUF;
+  bcache.minfree = n / 8;
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
+}
+
+// Put b at the front of queue q.
+static void
+benqueue(struct buf *b, int q)
+{
+  struct buf *head = &bcache.q[q];
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+  b->queue = q;
+  bcache.qlen[q]++;
+}
+
+// Take b off its queue.
+static void
+bdequeue(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  bcache.qlen[b->queue]--;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  int q;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.iolock, "bcache.io");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head = 0;
+  }
+  for(q = 0; q < NBQ; q++){
+    bcache.q[q].prev = &bcache.q[q];
+    bcache.q[q].next = &bcache.q[q];
+  }
+
+  blimit();
+  while(bcache.nbuf < NBUF){
+    if(bgrow() == 0)
+      panic("binit");
+  }
+}
+
+// Change the block size to size.  No buffer may be in use:
+// all of them are freed, and the cache starts again with
+// NBUF buffers of the new size.
+void
+bsetsize(uint size)
+{
+  struct bchunk *c;
+  int i;
+
+  if(size == bsize)
+    return;
+  acquire(&bcache.lock);
+  while((c = bcache.chunks) != 0){
+    if(!bdrain(c))
+      panic("bsetsize: busy");
+    bcache.chunks = c->next;
+    bcache.nbuf -= CHUNKBUF;
+    release(&bcache.lock);
+    for(i = 0; i < CHUNKBUF; i += BPP)
+      kfree(c->buf[i].data);
+    kfree(c);
+    acquire(&bcache.lock);
+  }
+  memset(bcache.ghost, 0, sizeof(bcache.ghost));
+  bsize = size;
+  release(&bcache.lock);
+
+  blimit();
+  while(bcache.nbuf < NBUF){
+    if(bgrow() == 0)
+      panic("bsetsize");
+  }
+}
+
+// Add a chunk of free buffers to the cache.
+// Returns 0 if out of memory.
+// Must not be called with bcache.lock held, since
+// kalloc() may call breclaim().
+static int
+bgrow(void)
+{
+  struct bchunk *c;
+  struct buf *b;
+  char *pa = 0;
+  int i;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  if((c = kalloc()) == 0)
+    return 0;
+  memset(c, 0, sizeof(*c));
+  for(i = 0; i < CHUNKBUF; i++){
+    b = &c->buf[i];
+    if(i % BPP == 0 && (pa = kalloc()) == 0){
+      while((i -= BPP) >= 0)
+        kfree(c->buf[i].data);
+      kfree(c);
+      return 0;
+    }
+    b->data = (uchar*)pa + (i % BPP) * bsize;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
   }
+
+  acquire(&bcache.lock);
+  for(b = c->buf; b < c->buf+CHUNKBUF; b++)
+    benqueue(b, BQ_FREE);
+  c->next = bcache.chunks;
+  bcache.chunks = c;
+  bcache.nbuf += CHUNKBUF;
+  release(&bcache.lock);
+  return 1;
+}
+
+// Look for block blockno of device dev on bucket bk's chain.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b != 0; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+// Remove b from bucket bk's chain.
+// Caller must hold bk->lock.
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != 0; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      b->hnext = 0;
+      return;
+    }
+  }
+  panic("bunhash");
+}
+
+// Look for an unused buffer on queue q, starting from the
+// back, and take it off its hash chain and off q.  With clock
+// set, an accessed buffer gets a second chance by moving to
+// the front of q; otherwise q is FIFO.  Returns 0 if every
+// buffer on q is in use.
+// Caller must hold bcache.lock.
+static struct buf*
+bsweep(int q, int clock)
+{
+  struct buf *b, *prev, *head = &bcache.q[q];
+  struct bucket *bk;
+  int n, found;
+
+  n = clock ? 2*bcache.qlen[q] : bcache.qlen[q];
+  for(b = head->prev; b != head && n-- > 0; b = prev){
+    prev = b->prev;
+
+    // b->dev and b->blockno only change while
+    // bcache.lock is held, so b stays on bk.
+    bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    found = b->refcnt == 0 && !(clock && b->accessed);
+    if(found)
+      bunhash(bk, b);
+    if(clock)
+      b->accessed = 0;
+    release(&bk->lock);
+
+    if(found){
+      bdequeue(b);
+      return b;
+    }
+    if(clock){
+      bdequeue(b);
+      benqueue(b, q);
+    }
+  }
+  return 0;
+}
+
+// Find an unused cached buffer to recycle.  Returns it off
+// its hash chain and queue, or 0 if every buffer is in use.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b = 0;
+
+  // Keep A1in to about a quarter of the cache.
+  if(bcache.qlen[BQ_A1IN] > bcache.nbuf/4 || bcache.qlen[BQ_AM] == 0)
+    b = bsweep(BQ_A1IN, 0);
+  if(b == 0 && (b = bsweep(BQ_AM, 1)) != 0)
+    return b;
+  if(b == 0 && (b = bsweep(BQ_A1IN, 0)) == 0)
+    return 0;
+
+  // Remember the block in A1out.
+  bcache.ghost[GHOSTKEY(b->dev, b->blockno) % NGHOST] =
+    GHOSTKEY(b->dev, b->blockno);
+  return b;
+}
+
+// Take a buffer to hold a new block: a free one if there
+// is one, otherwise a recycled one unless the caller would
+// rather grow the cache.  Returns 0 if there is none.
+// Caller must hold bcache.lock.
+static struct buf*
+bnew(int grow)
+{
+  struct buf *b;
+
+  if((b = bcache.q[BQ_FREE].prev) != &bcache.q[BQ_FREE]){
+    bdequeue(b);
+    return b;
+  }
+  if(grow)
+    return 0;
+  return bvictim();
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// If ifnew is set, return 0 instead of a cached buffer.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ifnew)
 {
   struct buf *b;
-
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  uint64 *g;
+  int grow;
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0)
+    goto found;
+  release(&bk->lock);
+
+  // Not cached.  Check again with bcache.lock held, since
+  // another process may have cached it in the meantime.
+  acquire(&bcache.lock);
+  grow = bcache.nbuf < bcache.maxbuf && kfreepages() > bcache.minfree;
+  for(;;){
+    acquire(&bk->lock);
+    if((b = bfind(bk, dev, blockno)) != 0){
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      goto found;
     }
+    release(&bk->lock);
+    if((b = bnew(grow)) != 0)
+      break;
+    release(&bcache.lock);
+    if(bgrow() == 0 && !grow)
+      panic("bget: no buffers");
+    grow = 0;
+    acquire(&bcache.lock);
+  }
+
+  // Was the block recently evicted from A1in?
+  g = &bcache.ghost[GHOSTKEY(dev, blockno) % NGHOST];
+  if(*g == GHOSTKEY(dev, blockno)){
+    *g = 0;
+    benqueue(b, BQ_AM);
+  } else {
+    benqueue(b, BQ_A1IN);
   }
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->accessed = 0;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+
+found:
+  if(ifnew){
+    release(&bk->lock);
+    return 0;
+  }
+  b->refcnt++;
+  b->accessed = 1;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Move all of chunk c's buffers to the free list, then take
+// them off it.  Returns 0, leaving c in the cache, if any of
+// its buffers is in use.
+// Caller must hold bcache.lock.
+static int
+bdrain(struct bchunk *c)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  // Check without the bucket locks first, so that a
+  // busy chunk usually keeps its cached blocks.
+  for(b = c->buf; b < c->buf+CHUNKBUF; b++){
+    if(b->refcnt != 0)
+      return 0;
+  }
+
+  for(b = c->buf; b < c->buf+CHUNKBUF; b++){
+    if(b->queue == BQ_FREE)
+      continue;
+    bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    if(b->refcnt != 0){
+      release(&bk->lock);
+      return 0;
+    }
+    bunhash(bk, b);
+    release(&bk->lock);
+    bdequeue(b);
+    benqueue(b, BQ_FREE);
+  }
+
+  for(b = c->buf; b < c->buf+CHUNKBUF; b++)
+    bdequeue(b);
+  return 1;
+}
+
+// The most bytes of blocks the cache will hold.
+uint64
+bcachesize(void)
+{
+  return (uint64)bcache.maxbuf * bsize;
+}
+
+// Called by kalloc() when it is out of pages.
+// Gives back a chunk of unused buffers, if there is one.
+// Returns 1 if it freed any memory.
+int
+breclaim(void)
+{
+  struct bchunk *c, **pc;
+  int i;
+
+  acquire(&bcache.lock);
+  for(pc = &bcache.chunks; (c = *pc) != 0; pc = &c->next){
+    if(bcache.nbuf - CHUNKBUF < NBUF)
+      break;
+    if(bdrain(c)){
+      *pc = c->next;
+      bcache.nbuf -= CHUNKBUF;
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      for(i = 0; i < CHUNKBUF; i += BPP)
+        kfree(c->buf[i].data);
+      kfree(c);
+      return 1;
     }
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+  return 0;
+}
+
+// Start reading or writing locked buf b, without waiting.
+static void
+bstart(struct buf *b, int write)
+{
+  b->disk = 1;
+  iosubmit(b, write);
+}
+
+// Drop a reference to b.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// Called by the disk driver when I/O on b has finished.
+// The contents of b now match the disk.
+void
+bdone(struct buf *b)
+{
+  // Once b->disk is clear, a waiter may release b and
+  // it may be recycled, so look at b->readahead first.
+  int readahead = b->readahead;
+
+  b->readahead = 0;
+  acquire(&bcache.iolock);
+  b->valid = 1;
+  b->disk = 0;
+  wakeup(b);
+  release(&bcache.iolock);
+
+  // No one waits for a readahead; release it on
+  // behalf of breadahead().
+  if(readahead){
+    releasesleep(&b->lock);
+    bput(b);
+  }
+}
+
+// Return a locked buf for the indicated block, having started
+// to read its contents if they are not cached.  Call bwait()
+// before using the data.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  if(!b->valid)
+    bstart(b, 0);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -92,25 +584,149 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
-  }
+  b = bread_async(dev, blockno);
+  bwait(b);
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it, for a caller that will overwrite all of its data.
+struct buf*
+bclaim(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
+// Start reading the indicated block into the cache, without
+// waiting for it, unless it is already cached.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  b->readahead = 1;
+  bstart(b, 0);
+}
+
+// Start writing b's contents to disk.  Must be locked.
+// Call bwait() before changing or releasing b.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  bstart(b, 1);
+}
+
+// Start writing the contents of locked buf b to block blockno
+// of dev, not to b's own block, leaving the cache alone.  sb
+// is a spare buf, not in the cache, to carry the request.
+// Call bwait(sb) before changing or releasing b.
+void
+bwrite_to(struct buf *b, struct buf *sb, uint dev, uint blockno)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_to");
+  memset(sb, 0, sizeof(*sb));
+  sb->dev = dev;
+  sb->blockno = blockno;
+  sb->data = b->data;
+  bstart(sb, 1);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bwrite_async(b);
+  bwait(b);
+}
+
+// Wait for I/O on b to finish.  If poll is set, first spin
+// for up to POLLUSEC checking the disk for completions, since
+// a fast disk may finish sooner than the interrupt, sleep and
+// wakeup would let us know.
+static void
+bwait1(struct buf *b, int poll)
+{
+  uint64 t;
+  int polled;
+
+  if(!b->disk)
+    return;
+
+  // b may be on this process's plug list.
+  ioflush();
+
+  polled = 0;
+  if(poll && bdevsw[major(b->dev)].poll){
+    t = iotime();
+    while(b->disk && iotime() - t < POLLUSEC * MTIME_PER_USEC)
+      bdevsw[major(b->dev)].poll(minor(b->dev));
+    polled = !b->disk;
+  }
+
+  acquire(&bcache.iolock);
+  while(b->disk)
+    sleep(b, &bcache.iolock);
+  release(&bcache.iolock);
+
+  iolatency(polled, iotime() - b->tstart);
+}
+
+// Wait for I/O started on locked buf b to finish,
+// polling first if DISKPOLL is set.
+void
+bwait(struct buf *b)
+{
+  bwait1(b, DISKPOLL);
+}
+
+// Wait for I/O started on locked buf b to finish,
+// polling first.
+void
+bwaitpoll(struct buf *b)
+{
+  bwait1(b, 1);
+}
+
+// Whether dev has a driver, and the driver has the device.
+int
+bdevopen(uint dev)
+{
+  int maj = major(dev);
+
+  return maj >= 0 && maj < NDEV && bdevsw[maj].rw != 0 &&
+    bdevsw[maj].open != 0 && bdevsw[maj].open(minor(dev));
+}
+
+// Whether dev's contents are lost on a reboot, so that there
+// is no point in logging its blocks.
+int
+bnolog(uint dev)
+{
+  return bdevsw[major(dev)].nolog;
+}
+
+// Tell dev's driver, if it wants to know, that the nblocks
+// blocks starting at blockno are free.  Waits for the driver.
+void
+bdiscard(uint dev, uint blockno, uint nblocks)
+{
+  struct bdevsw *sw = &bdevsw[major(dev)];
+
+  if(sw->discard)
+    sw->discard(minor(dev), blockno, nblocks);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// The buffer stays cached until bvictim() recycles it.
 void
 brelse(struct buf *b)
 {
@@ -118,34 +734,19 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
 }
-
-
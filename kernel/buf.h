@@ -1,13 +1,21 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int readahead; // release when the read finishes?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int accessed; // used since the last clock sweep?
+  int queue;    // replacement queue (see bio.c)
+  struct buf *hnext; // hash chain
+  struct buf *prev; // replacement queue
   struct buf *next;
-  struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  struct buf *qnext; // plug list; blocks in one disk request
+  int write;    // queued I/O is a write
+  uint64 tstart; // when the disk request was dispatched
+  int logged;   // log transactions holding this block
+  uint64 ordseq; // last transaction it was ordered data in
+  uchar *data;  // bsize bytes in a kalloc()ed page
 };
 
@@ -147,6 +147,7 @@ consoleintr(int c)
   switch(c){
   case C('P'):  // Print process list.
     procdump();
+    iodump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
@@ -10,12 +10,27 @@ struct stat;
 struct superblock;
 
 // bio.c
+extern uint     bsize;
 void            binit(void);
+void            bsetsize(uint);
 struct buf*     bread(uint, uint);
+struct buf*     bread_async(uint, uint);
+struct buf*     bclaim(uint, uint);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwrite_to(struct buf*, struct buf*, uint, uint);
+void            bwait(struct buf*);
+void            bwaitpoll(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             breclaim(void);
+uint64          bcachesize(void);
+void            bdiscard(uint, uint, uint);
+int             bdevopen(uint);
+int             bnolog(uint);
 
 // console.c
 void            consoleinit(void);
@@ -32,10 +47,12 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filesync(struct file*, int);
 int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
+int             fsmount(uint, struct inode*, int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -43,31 +60,57 @@ struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
+void            ireadahead(struct inode*, uint, uint);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+void            isync(struct inode*, int);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
-int             readi(struct inode*, int, uint64, uint, uint);
+int             readi(struct inode*, int, uint64, uint64, uint);
 void            stati(struct inode*, struct stat*);
-int             writei(struct inode*, int, uint64, uint, uint);
+int             writei(struct inode*, int, uint64, uint64, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+uint64          ramdiskbase(void);
+uint64          ramdisksize(void);
+int             ramdiskopen(int);
+void            ramdiskrw(struct buf*, int);
+
+// iosched.c
+void            ioinit(void);
+void            iosubmit(struct buf*, int);
+void            iodone(struct buf*);
+int             iostat(int, uint64);
+void            ioplug(void);
+void            iounplug(void);
+void            ioflush(void);
+void            iodump(void);
+uint64          iotime(void);
+void            iolatency(int, uint64);
 
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit();
+uint64          kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_ordered(struct buf*);
+void            log_discard(uint, uint);
+void            log_undiscard(uint, uint);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+int             log_maxop(void);
+int             log_room(int);
+void            log_split(void);
+uint64          log_seq(void);
+void            log_force(uint64);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -88,6 +131,7 @@ int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread(void (*)(void), char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -121,6 +165,9 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// start.c
+extern uint64   dtb;
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -179,8 +226,12 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
+int             virtio_disk_open(int);
 void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr();
+void            virtio_disk_intr(int);
+void            virtio_disk_dump(void);
+void            virtio_disk_poll(int);
+void            virtio_disk_discard(int, uint, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -2,3 +2,7 @@
 #define O_WRONLY  0x001
 #define O_RDWR    0x002
 #define O_CREATE  0x200
+
+// mount() flags
+#define MNT_DISCARD 0x001  // tell the disk about freed blocks
+#define MNT_ORDERED 0x002  // write file data home, not through the log
@@ -14,6 +14,7 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+struct bdevsw bdevsw[NDEV];
 struct {
   struct spinlock lock;
   struct file file[NFILE];
@@ -101,6 +102,20 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Make file f's changes durable; only those to its data and
+// size if datasync is set.
+int
+filesync(struct file *f, int datasync)
+{
+  if(f->type == FD_INODE){
+    isync(f->ip, datasync);
+    return 0;
+  }
+  if(f->type == FD_DEVICE)
+    return 0;
+  return -1;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -146,20 +161,18 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as many blocks at a time as one FS call may
+    // put in a log transaction (see WRITEBLOCKS).
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((log_maxop() - WRITEBLOCKS(0)) / 2) * bsize;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(WRITEBLOCKS((n1 + bsize - 1) / bsize));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
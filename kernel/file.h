@@ -5,7 +5,7 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint64 off;        // FD_INODE
   short major;       // FD_DEVICE
 };
 
@@ -20,13 +20,22 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint mounted;       // device mounted on this directory, or 0
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
-  uint size;
-  uint addrs[NDIRECT+1];
+  uint64 size;
+  uint addrs[NADDRS];
+  uchar flags;
+
+  uint64 raoff;       // offset where the last read ended
+  uint rawin;         // readahead window, in blocks
+  uint ranext;        // next block to read ahead
+
+  uint64 seq;         // last log transaction that changed it
+  uint64 dataseq;     // same, for its data or size
 };
 
 // map major device number to device functions.
@@ -38,3 +47,18 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+
+// map major block device number to driver functions.
+struct buf;
+struct bdevsw {
+  int (*open)(int);                // does this minor device exist?
+  void (*rw)(struct buf*, int);    // start I/O on a chain of bufs
+  void (*poll)(int);               // look for finished I/O
+  void (*discard)(int, uint, uint); // drop blocks' contents; may be 0
+  int nolog;                       // contents don't outlive a reboot
+};
+
+extern struct bdevsw bdevsw[];
+
+#define VDISK 1    // virtio disk; minor is the mmio slot
+#define RAMDISK 2  // image loaded by qemu -initrd
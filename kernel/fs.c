@@ -20,68 +20,305 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "fcntl.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
-// there should be one superblock per disk device, but we run with
-// only one device
-struct superblock sb; 
 
-// Read the super block.
+// Mounted file systems, each with a copy of its superblock.
+// m[0] is the root.  Entries are filled in under the lock and
+// never change or go away, and dev is set last, so an entry
+// with the dev being looked for can be used without the lock.
+// A mounted-on directory holds the reference in ip, so it
+// stays in the inode cache with ip->mounted set.
+// For balloc(), each entry also keeps a count of the free
+// blocks in each bitmap block, so that it can skip full ones
+// without reading them.
+struct {
+  struct spinlock lock;
+  struct mount {
+    uint dev;
+    struct superblock sb;
+    struct inode *ip;   // directory mounted on; 0 for the root
+    int flags;          // MNT_ flags
+    struct spinlock alock; // protects nfree and cursor
+    ushort *nfree;      // free blocks per bitmap block, in a page
+    uint cursor;        // bitmap block to allocate from next
+  } m[NMOUNT];
+} mtable;
+
+// Read the super block, at byte SBOFF, in blocks of the
+// buffer cache's size.
 static void
 readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
 
-  bp = bread(dev, 1);
-  memmove(sb, bp->data, sizeof(*sb));
+  bp = bread(dev, SBOFF / bsize);
+  memmove(sb, bp->data + SBOFF % bsize, sizeof(*sb));
   brelse(bp);
 }
 
+// Is sb's block size one that can be used?
+static int
+goodbsize(struct superblock *sb)
+{
+  return sb->bsize >= MINBSIZE && sb->bsize <= BSIZE &&
+    (sb->bsize & (sb->bsize - 1)) == 0;
+}
+
+// Return the mount table entry for dev.
+static struct mount*
+getmount(uint dev)
+{
+  struct mount *m;
+
+  for(m = mtable.m; m < &mtable.m[NMOUNT]; m++){
+    if(m->dev == dev)
+      return m;
+  }
+  panic("getmount");
+}
+
+// The superblock of the file system on dev.
+static struct superblock*
+getsb(uint dev)
+{
+  return &getmount(dev)->sb;
+}
+
+// Bitmap blocks of a file system.
+static int
+nbitmap(struct superblock *sb)
+{
+  return (sb->size + BPB(bsize) - 1) / BPB(bsize);
+}
+
+// Bits in bitmap block i that stand for blocks.
+static int
+nbits(struct superblock *sb, int i)
+{
+  return min(BPB(bsize), sb->size - i*BPB(bsize));
+}
+
+// Count the free blocks in each bitmap block of the file
+// system on dev, into a kalloc()ed page.  Returns 0 if the
+// file system has too many bitmap blocks.
+static ushort*
+bcount(int dev, struct superblock *sb)
+{
+  ushort *nfree;
+  uint64 *w, x;
+  struct buf *bp;
+  int i, j, n;
+
+  if(nbitmap(sb) > PGSIZE / sizeof(ushort) || BPB(bsize) > 0xffff)
+    return 0;
+  if((nfree = (ushort*)kalloc()) == 0)
+    return 0;
+  for(i = 0; i < nbitmap(sb); i++){
+    bp = bread(dev, sb->bmapstart + i);
+    w = (uint64*)bp->data;
+    n = nbits(sb, i);
+    nfree[i] = 0;
+    for(j = 0; j < n; j += 64){
+      x = ~w[j/64];
+      if(n - j < 64)
+        x &= ((uint64)1 << (n - j)) - 1;
+      for(; x; x &= x - 1)
+        nfree[i]++;
+    }
+    brelse(bp);
+  }
+  return nfree;
+}
+
 // Init fs
 void
 fsinit(int dev) {
+  struct mount *m = &mtable.m[0];
+
+  initlock(&mtable.lock, "mtable");
+  readsb(dev, &m->sb);
+  if(m->sb.magic != FSMAGIC || !goodbsize(&m->sb))
+    panic("invalid file system");
+  // the cache starts out with blocks of MINBSIZE, enough
+  // to read the super block.
+  bsetsize(m->sb.bsize);
+  if(m->sb.flags & SB_ORDERED)
+    m->flags |= MNT_ORDERED;
+  initlock(&m->alock, "alloc");
+  initlog(dev, &m->sb);
+  // count free blocks once recovery has brought the bitmap
+  // up to date.
+  if((m->nfree = bcount(dev, &m->sb)) == 0)
+    panic("fsinit: bitmap");
+  m->dev = dev;
+}
+
+// Mount the file system on block device dev on directory ip,
+// with MNT_ flags.  The mount takes over the caller's
+// reference to ip.  Returns 0 on success, -1 on error.
+int
+fsmount(uint dev, struct inode *ip, int flags)
+{
+  struct superblock sb;
+  struct mount *m, *free;
+  ushort *nfree;
+
+  if(!bdevopen(dev))
+    return -1;
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
-    panic("invalid file system");
-  initlog(dev, &sb);
+    return -1;
+  // the log holds blocks of every mounted file system,
+  // in blocks of the root's size.
+  if(sb.bsize != bsize){
+    printf("fsmount: dev %x has %d-byte blocks, not the root's %d\n",
+           dev, sb.bsize, bsize);
+    return -1;
+  }
+  if(sb.flags & SB_ORDERED)
+    flags |= MNT_ORDERED;
+  if((nfree = bcount(dev, &sb)) == 0)
+    return -1;
+
+  acquire(&mtable.lock);
+  if(ip->mounted){
+    release(&mtable.lock);
+    kfree(nfree);
+    return -1;
+  }
+  free = 0;
+  for(m = mtable.m; m < &mtable.m[NMOUNT]; m++){
+    if(m->dev == dev){
+      release(&mtable.lock);
+      kfree(nfree);
+      return -1;
+    }
+    if(free == 0 && m->dev == 0)
+      free = m;
+  }
+  if(free == 0){
+    release(&mtable.lock);
+    kfree(nfree);
+    return -1;
+  }
+  free->sb = sb;
+  free->ip = ip;
+  free->flags = flags;
+  initlock(&free->alock, "alloc");
+  free->nfree = nfree;
+  free->cursor = 0;
+  ip->mounted = dev;
+  __sync_synchronize();
+  free->dev = dev;
+  release(&mtable.lock);
+  return 0;
 }
 
-// Zero a block.
+// Zero a block, which holds file data in ordered mode
+// if data is set.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  bp = bclaim(dev, bno);
+  memset(bp->data, 0, bsize);
+  if(data)
+    log_ordered(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
+// Is ip's content file data to be written in ordered mode?
+// Otherwise it goes through the log, like all metadata.
+static int
+ordered(struct inode *ip)
+{
+  return ip->type == T_FILE && (getmount(ip->dev)->flags & MNT_ORDERED);
+}
+
 // Blocks.
 
-// Allocate a zeroed disk block.
+// The first clear bit in bitmap block bp at or after bit
+// from and before bit n, or -1 if there is none.  Looks at
+// 64 bits at a time.
+static int
+bscan(struct buf *bp, int from, int n)
+{
+  uint64 *w = (uint64*)bp->data;
+  uint64 x;
+  int i, bi;
+
+  for(i = from/64; i*64 < n; i++){
+    x = w[i];
+    if(i == from/64)
+      x |= ((uint64)1 << (from % 64)) - 1;  // bits before from
+    if(x == ~(uint64)0)
+      continue;
+    for(bi = i*64; x & 1; bi++)
+      x >>= 1;
+    return bi < n ? bi : -1;
+  }
+  return -1;
+}
+
+// Allocate a zeroed disk block, for file data in ordered
+// mode if data is set.  Prefers the first free block after
+// near, if that is nonzero, so that a file's blocks stay
+// together; otherwise starts from the bitmap block the last
+// allocation came from.  Skips bitmap blocks with no free
+// blocks without reading them.
 static uint
-balloc(uint dev)
+balloc(uint dev, int data, uint near)
 {
-  int b, bi, m;
+  struct mount *m = getmount(dev);
+  struct superblock *sb = &m->sb;
+  int nb = nbitmap(sb);
+  int i, k, bi, from, first, free;
   struct buf *bp;
+  uint b;
+
+  if(near > 0 && near + 1 < sb->size){
+    i = (near + 1) / BPB(bsize);
+    from = (near + 1) % BPB(bsize);
+  } else {
+    acquire(&m->alock);
+    i = m->cursor;
+    release(&m->alock);
+    from = 0;
+  }
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  // Visit each bitmap block once, and the first one again
+  // from its start if the search began part way through it.
+  first = from;
+  for(k = 0; k <= nb; k++, i = (i + 1) % nb, from = 0){
+    if(k == nb && first == 0)
+      break;
+    acquire(&m->alock);
+    free = m->nfree[i];
+    release(&m->alock);
+    if(free == 0)
+      continue;
+    bp = bread(dev, sb->bmapstart + i);
+    if((bi = bscan(bp, from, nbits(sb, i))) < 0){
+      brelse(bp);
+      continue;
     }
+    bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+    log_write(bp);
+    acquire(&m->alock);
+    m->nfree[i]--;
+    m->cursor = i;
+    release(&m->alock);
     brelse(bp);
+    b = i*BPB(bsize) + bi;
+    log_undiscard(dev, b);
+    bzero(dev, b, data);
+    return b;
   }
   panic("balloc: out of blocks");
 }
@@ -90,17 +327,23 @@ balloc(uint dev)
 static void
 bfree(int dev, uint b)
 {
+  struct mount *m = getmount(dev);
   struct buf *bp;
-  int bi, m;
+  int bi, mask;
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
+  bp = bread(dev, BBLOCK(b, m->sb));
+  bi = b % BPB(bsize);
+  mask = 1 << (bi % 8);
+  if((bp->data[bi/8] & mask) == 0)
     panic("freeing free block");
-  bp->data[bi/8] &= ~m;
+  bp->data[bi/8] &= ~mask;
   log_write(bp);
+  acquire(&m->alock);
+  m->nfree[b / BPB(bsize)]++;
+  release(&m->alock);
   brelse(bp);
+  if(m->flags & MNT_DISCARD)
+    log_discard(dev, b);
 }
 
 // Inodes.
@@ -199,13 +442,16 @@ ialloc(uint dev, short type)
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct superblock *sb = getsb(dev);
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
+  for(inum = 1; inum < sb->ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, (*sb)));
+    dip = (struct dinode*)bp->data + inum%IPB(bsize);
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if((type == T_FILE || type == T_DIR) && (sb->flags & SB_EXTENT))
+        dip->flags = I_EXTENT;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -225,9 +471,10 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-  dip = (struct dinode*)bp->data + ip->inum%IPB;
+  bp = bread(ip->dev, IBLOCK(ip->inum, (*getsb(ip->dev))));
+  dip = (struct dinode*)bp->data + ip->inum%IPB(bsize);
   dip->type = ip->type;
+  dip->flags = ip->flags;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
@@ -235,6 +482,7 @@ iupdate(struct inode *ip)
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->seq = log_seq();
 }
 
 // Find the inode with number inum on device dev
@@ -268,6 +516,9 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->mounted = 0;
+  // its last change is unknown; assume it is not yet committed.
+  ip->seq = ip->dataseq = log_seq();
   release(&icache.lock);
 
   return ip;
@@ -298,15 +549,19 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
+    bp = bread(ip->dev, IBLOCK(ip->inum, (*getsb(ip->dev))));
+    dip = (struct dinode*)bp->data + ip->inum%IPB(bsize);
     ip->type = dip->type;
+    ip->flags = dip->flags;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->raoff = 0;
+    ip->rawin = 0;
+    ip->ranext = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -329,7 +584,9 @@ iunlock(struct inode *ip)
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
-// case it has to free the inode.
+// case it has to free the inode.  Freeing a big file may
+// commit the transaction and go on in a new one (see
+// tfree()), so callers hold no other inode locks.
 void
 iput(struct inode *ip)
 {
@@ -371,38 +628,313 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The next NDINDIRECT
+// are listed in the blocks listed in block ip->addrs[NDIRECT+1],
+// and the NTINDIRECT after those one level further down from
+// block ip->addrs[NDIRECT+2].
+//
+// An inode with I_EXTENT set instead keeps the root of an
+// extent tree in ip->addrs[] (see struct exthdr), which maps
+// each run of adjacent blocks with one entry.
+
+// The entries of extent tree node h.
+static struct extent*
+extents(struct exthdr *h)
+{
+  return (struct extent*)(h + 1);
+}
+
+// The last entry in node h with e->bn <= bn, or 0.
+static struct extent*
+esearch(struct exthdr *h, uint bn)
+{
+  struct extent *e = extents(h);
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = h->n;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(e[mid].bn <= bn)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &e[lo-1] : 0;
+}
+
+// Add a block to the end of extent-mapped ip, which has bn
+// blocks.  Extends the last extent if the new block follows
+// it on the disk; otherwise adds an extent, and if the leaf
+// it goes in is full, a path of new nodes down to a new leaf
+// from the lowest node on the right edge of the tree with
+// room, after moving the root down a level if need be.
+static uint
+eappend(struct inode *ip, uint bn)
+{
+  struct exthdr *h[EXTDEPTH+1];
+  struct buf *bp[EXTDEPTH+1];
+  struct extent *e;
+  struct buf *nbp;
+  uint addr, node;
+  int d, k, depth;
+
+  // Walk down the right edge.
+  h[0] = (struct exthdr*)ip->addrs;
+  bp[0] = 0;
+  depth = h[0]->depth;
+  if(depth > EXTDEPTH)
+    panic("eappend: depth");
+  for(d = 1; d <= depth; d++){
+    e = &extents(h[d-1])[h[d-1]->n - 1];
+    bp[d] = bread(ip->dev, e->start);
+    h[d] = (struct exthdr*)bp[d]->data;
+  }
+
+  e = h[depth]->n > 0 ? &extents(h[depth])[h[depth]->n - 1] : 0;
+  if(e && e->bn + e->len != bn)
+    panic("eappend: hole");
+  addr = balloc(ip->dev, ordered(ip), e ? e->start + e->len - 1 : 0);
+  if(e && e->start + e->len == addr){
+    e->len++;
+    if(bp[depth])
+      log_write(bp[depth]);
+    goto out;
+  }
+
+  // The lowest node with room for another entry.
+  for(k = depth; k >= 0; k--){
+    if(h[k]->n < (k == 0 ? NIEXT : NBEXT(bsize)))
+      break;
+  }
+  if(k < 0){
+    // Move the root's entries down into a new node.
+    if(depth == EXTDEPTH)
+      panic("eappend: too many extents");
+    node = balloc(ip->dev, 0, addr);
+    nbp = bread(ip->dev, node);
+    memmove(nbp->data, h[0], sizeof(struct exthdr) + h[0]->n*sizeof(struct extent));
+    log_write(nbp);
+    e = extents(h[0]);
+    e->start = node;
+    e->len = 0;
+    h[0]->n = 1;
+    h[0]->depth++;
+    for(d = depth + 1; d > 1; d--){
+      bp[d] = bp[d-1];
+      h[d] = h[d-1];
+    }
+    bp[1] = nbp;
+    h[1] = (struct exthdr*)nbp->data;
+    depth++;
+    k = 0;
+  }
+
+  // Hang a path of new nodes, ending in a leaf holding
+  // just the new extent, below node k.
+  e = &extents(h[k])[h[k]->n++];
+  e->bn = bn;
+  for(d = k + 1; d <= depth; d++){
+    node = balloc(ip->dev, 0, addr);
+    e->start = node;
+    e->len = 0;
+    if(bp[d-1])
+      log_write(bp[d-1]);
+    if(bp[d])
+      brelse(bp[d]);
+    bp[d] = bread(ip->dev, node);
+    h[d] = (struct exthdr*)bp[d]->data;
+    h[d]->n = 1;
+    h[d]->depth = depth - d;
+    e = extents(h[d]);
+    e->bn = bn;
+  }
+  e->start = addr;
+  e->len = 1;
+  if(bp[depth])
+    log_write(bp[depth]);
+
+out:
+  for(d = 1; d <= depth; d++)
+    brelse(bp[d]);
+  return addr;
+}
+
+// Return the disk block address of block bn of
+// extent-mapped ip, adding it if bn is just past the end.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct exthdr *h = (struct exthdr*)ip->addrs;
+  struct extent *e;
+  struct buf *bp = 0;
+  uint addr = 0;
+
+  while((e = esearch(h, bn)) != 0){
+    if(h->depth == 0){
+      if(bn < e->bn + e->len)
+        addr = e->start + (bn - e->bn);
+      break;
+    }
+    addr = e->start;
+    if(bp)
+      brelse(bp);
+    bp = bread(ip->dev, addr);
+    h = (struct exthdr*)bp->data;
+    addr = 0;
+  }
+  if(bp)
+    brelse(bp);
+  if(addr == 0)
+    addr = eappend(ip, bn);
+  return addr;
+}
+
+// Free block b of ip, for itrunc().  Each freed block may
+// dirty another bitmap block, so a big file has more to log
+// than one FS call may; whenever the call's reservation is
+// nearly used up, record what has been freed so far in the
+// inode, and go on in a new transaction.  ip has no links and
+// no other references, so nothing else sees it in between.
+static void
+tfree(struct inode *ip, uint b)
+{
+  // room for b's bitmap block, and ip's, now or at the end.
+  if(!log_room(3)){
+    iupdate(ip);
+    log_split();
+  }
+  bfree(ip->dev, b);
+}
+
+// Free the blocks that an extent tree node maps, and the
+// nodes below it: the root, h, or if h is 0 the node in
+// block node.  A node is read again for each entry rather
+// than kept locked, since tfree() may wait for a commit,
+// which may need to lock it.
+static void
+efree(struct inode *ip, struct exthdr *h, uint node)
+{
+  struct exthdr hd;
+  struct extent e;
+  struct buf *bp = 0;
+  uint b;
+  int i;
+
+  for(i = 0; ; i++){
+    if(h == 0){
+      bp = bread(ip->dev, node);
+      h = (struct exthdr*)bp->data;
+    }
+    hd = *h;
+    if(i < hd.n)
+      e = extents(h)[i];
+    if(bp){
+      brelse(bp);
+      bp = 0;
+      h = 0;
+    }
+    if(i >= hd.n)
+      break;
+    if(hd.depth == 0){
+      for(b = 0; b < e.len; b++)
+        tfree(ip, e.start + b);
+    } else {
+      efree(ip, 0, e.start);
+      tfree(ip, e.start);
+    }
+  }
+}
+
+// Return the disk block address of block bn of the blocks
+// reached through levels of indirect blocks from ip->addrs[i],
+// allocating any that are missing.
+static uint
+bmapind(struct inode *ip, int i, uint bn, int levels)
+{
+  uint addr, span, x, *a;
+  struct buf *bp;
+  int l;
+
+  if((addr = ip->addrs[i]) == 0)
+    ip->addrs[i] = addr = balloc(ip->dev, 0, ip->addrs[i-1]);
+  span = 1;
+  for(l = 1; l < levels; l++)
+    span *= NINDIRECT(bsize);
+
+  for(l = levels; l > 0; l--){
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    x = bn / span;
+    if(a[x] == 0){
+      a[x] = balloc(ip->dev, l == 1 ? ordered(ip) : 0,
+                    x > 0 ? a[x-1] : addr);
+      log_write(bp);
+    }
+    addr = a[x];
+    brelse(bp);
+    bn %= span;
+    span /= NINDIRECT(bsize);
+  }
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
+
+  if(ip->flags & I_EXTENT)
+    return emap(ip, bn);
 
+  // New blocks go after the one before them in the file.
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr =
+        balloc(ip->dev, ordered(ip), bn > 0 ? ip->addrs[bn-1] : 0);
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+  if(bn < NINDIRECT(bsize))
+    return bmapind(ip, NDIRECT, bn, 1);
+  bn -= NINDIRECT(bsize);
+
+  if(bn < NDINDIRECT(bsize))
+    return bmapind(ip, NDIRECT+1, bn, 2);
+  bn -= NDINDIRECT(bsize);
+
+  if(bn < NTINDIRECT(bsize))
+    return bmapind(ip, NDIRECT+2, bn, 3);
+
+  panic("bmap: out of range");
+}
+
+// Free indirect block addr, which has levels of indirect
+// blocks below it, and the blocks it leads to.  addr is read
+// again for each entry rather than kept locked, since
+// tfree() may wait for a commit, which may need to lock it.
+static void
+bfreeind(struct inode *ip, uint addr, int levels)
+{
+  struct buf *bp;
+  uint x;
+  int j;
+
+  for(j = 0; j < NINDIRECT(bsize); j++){
     bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
+    x = ((uint*)bp->data)[j];
     brelse(bp);
-    return addr;
+    if(x == 0)
+      continue;
+    if(levels > 1)
+      bfreeind(ip, x, levels - 1);
+    else
+      tfree(ip, x);
   }
-
-  panic("bmap: out of range");
+  tfree(ip, addr);
 }
 
 // Truncate inode (discard contents).
@@ -413,33 +945,58 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  if(ip->flags & I_EXTENT){
+    efree(ip, (struct exthdr*)ip->addrs, 0);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+
+  // Start reading the indirect blocks while the
+  // direct blocks are freed.
+  ioplug();
+  for(i = NDIRECT; i < NADDRS; i++){
+    if(ip->addrs[i])
+      breadahead(ip->dev, ip->addrs[i]);
+  }
+  iounplug();
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
+      tfree(ip, ip->addrs[i]);
       ip->addrs[i] = 0;
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = NDIRECT; i < NADDRS; i++){
+    if(ip->addrs[i]){
+      bfreeind(ip, ip->addrs[i], i - NDIRECT + 1);
+      ip->addrs[i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
   iupdate(ip);
 }
 
+// Make ip's changes durable: all of them, or if datasync is
+// set, those to its data and size.
+void
+isync(struct inode *ip, int datasync)
+{
+  uint64 seq;
+
+  ilock(ip);
+  seq = ip->dataseq;
+  if(!datasync && ip->seq > seq)
+    seq = ip->seq;
+  iunlock(ip);
+  log_force(seq);
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -452,12 +1009,72 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential readahead.  A read of ip that starts where the
+// previous one ended is part of a sequential scan, so start
+// reading the blocks after it without waiting, letting the disk
+// work while the reader copies.  The window doubles with each
+// sequential read, up to MAXREADAHEAD blocks.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint64 off, uint n)
+{
+  uint bn, end, nblocks;
+
+  if(off != ip->raoff){
+    ip->rawin = 0;
+    ip->ranext = 0;
+  } else if(ip->rawin < MAXREADAHEAD){
+    ip->rawin = ip->rawin ? 2*ip->rawin : 2;
+    if(ip->rawin > MAXREADAHEAD)
+      ip->rawin = MAXREADAHEAD;
+  }
+  ip->raoff = off + n;
+  if(ip->rawin == 0 || n == 0)
+    return;
+
+  // Blocks below ip->size are always allocated,
+  // so bmap() won't allocate one here.
+  bn = (off + n - 1) / bsize + 1;
+  end = bn + ip->rawin;
+  nblocks = (ip->size + bsize - 1) / bsize;
+  if(end > nblocks)
+    end = nblocks;
+  if(bn < ip->ranext)
+    bn = ip->ranext;
+  ioplug();
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  iounplug();
+  if(end > ip->ranext)
+    ip->ranext = end;
+}
+
+// Start reading the blocks holding bytes [off, off+n) of ip,
+// without waiting, for a caller that knows it will soon read
+// all of them (e.g. exec loading a segment).
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end;
+
+  if(off >= ip->size || n == 0)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+  end = (off + n + bsize - 1) / bsize;
+  ioplug();
+  for(bn = off / bsize; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  iounplug();
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
-readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+readi(struct inode *ip, int user_dst, uint64 dst, uint64 off, uint n)
 {
   uint tot, m;
   struct buf *bp;
@@ -466,11 +1083,12 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    bp = bread(ip->dev, bmap(ip, off/bsize));
+    m = min(n - tot, bsize - off%bsize);
+    if(either_copyout(user_dst, dst, bp->data + (off % bsize), m) == -1) {
       brelse(bp);
       break;
     }
@@ -484,28 +1102,32 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
 int
-writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+writei(struct inode *ip, int user_src, uint64 src, uint64 off, uint n)
 {
   uint tot, m;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > (uint64)MAXFILE(bsize)*bsize)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+    bp = bread(ip->dev, bmap(ip, off/bsize));
+    m = min(n - tot, bsize - off%bsize);
+    if(either_copyin(bp->data + (off % bsize), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ordered(ip))
+      log_ordered(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
   if(n > 0){
+    ip->dataseq = log_seq();
     if(off > ip->size)
       ip->size = off;
     // write the i-node back to disk even if the size didn't change
@@ -626,6 +1248,9 @@ skipelem(char *path, char *name)
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 // Must be called inside a transaction since it calls iput().
+// A directory with a file system mounted on it stands for the
+// root of that file system, and ".." in that root leads to the
+// directory's parent.
 static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
@@ -637,6 +1262,12 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(ip->inum == ROOTINO && ip->dev != ROOTDEV &&
+       namecmp(name, "..") == 0){
+      next = idup(getmount(ip->dev)->ip);
+      iput(ip);
+      ip = next;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -653,6 +1284,11 @@ namex(char *path, int nameiparent, char *name)
     }
     iunlockput(ip);
     ip = next;
+    if(ip->mounted){
+      next = iget(ip->mounted, ROOTINO);
+      iput(ip);
+      ip = next;
+    }
   }
   if(nameiparent){
     iput(ip);
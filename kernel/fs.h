@@ -3,12 +3,18 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#define BSIZE 4096  // largest block size
+#define MINBSIZE 1024  // smallest block size
+#define SBOFF 1024  // byte offset of the super block on the disk
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
+// The block size is a property of the file system, a power of two
+// from MINBSIZE to BSIZE.  The super block is always at byte SBOFF,
+// which with blocks bigger than that puts it in block 0.
+//
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
 struct superblock {
@@ -20,35 +26,104 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // SB_ flags
+  uint bsize;        // Block size (bytes)
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// superblock flags
+#define SB_ORDERED 0x001  // journal only metadata; mount as MNT_ORDERED
+#define SB_WRITEBACK 0x002 // root: FS calls don't wait for commits
+#define SB_EXTENT  0x004  // new files and directories get I_EXTENT
+
+#define NDIRECT 9
+// These depend on the block size, bs.
+#define NINDIRECT(bs) ((bs) / sizeof(uint))
+#define NDINDIRECT(bs) (NINDIRECT(bs) * NINDIRECT(bs))
+#define NTINDIRECT(bs) (NDINDIRECT(bs) * NINDIRECT(bs))
+#define MAXFILE(bs) (NDIRECT + NINDIRECT(bs) + NDINDIRECT(bs) + NTINDIRECT(bs))
+
+// addrs[] holds NDIRECT block numbers and then those of a
+// singly, a doubly and a triply indirect block.
+#define NADDRS (NDIRECT + 3)
 
 // On-disk inode structure
 struct dinode {
-  short type;           // File type
+  uchar type;           // File type
+  uchar flags;          // I_ flags
   short major;          // Major device number (T_DEVICE only)
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
-  uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint64 size;          // Size of file (bytes)
+  uint addrs[NADDRS];   // Data block addresses
+};
+
+// inode flags
+#define I_EXTENT 0x01   // addrs[] holds the root of an extent tree
+
+// An extent-mapped inode's blocks are found through a tree
+// whose root is in addrs[] and whose other nodes are blocks.
+// Each node is a header and then entries sorted by bn.  In a
+// leaf (depth 0) each entry maps file blocks [bn, bn+len) to
+// disk blocks [start, start+len); otherwise it points to the
+// node at block start, which maps the file blocks from bn up
+// to the next entry's bn.
+struct exthdr {
+  ushort n;             // entries in use
+  ushort depth;         // levels of nodes below this one
+};
+
+struct extent {
+  uint bn;              // first file block
+  uint start;           // first disk block, or node
+  uint len;             // blocks; 0 in a non-leaf
 };
 
+#define NIEXT ((sizeof(uint)*NADDRS - sizeof(struct exthdr)) / sizeof(struct extent))
+#define NBEXT(bs) (((bs) - sizeof(struct exthdr)) / sizeof(struct extent))
+#define EXTDEPTH 4      // most levels below the root
+
+// Log blocks that writing n file blocks may need, for n less
+// than an indirect block or extent tree node maps: the blocks
+// and a bitmap block for each, one more of each if the write
+// isn't block-aligned, the i-node, and index blocks.  At each
+// level of indirect blocks (3) or of the extent tree (up to
+// EXTDEPTH) the write changes at most the block it starts in
+// and a new one, which needs a bitmap block too.
+#define WRITEBLOCKS(n) (2*((n) + 1) + 1 + 2*2*EXTDEPTH)
+
 // Inodes per block.
-#define IPB           (BSIZE / sizeof(struct dinode))
+#define IPB(bs)       ((bs) / sizeof(struct dinode))
 
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb)     ((i) / IPB(sb.bsize) + sb.inodestart)
 
 // Bitmap bits per block
-#define BPB           (BSIZE*8)
+#define BPB(bs)       ((bs)*8)
 
 // Block of free map containing bit for block b
-#define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
+#define BBLOCK(b, sb) ((b)/BPB(sb.bsize) + sb.bmapstart)
+
+// The log (see kernel/log.c) holds transactions, each of
+// descriptor blocks listing its blocks, DESCTAGS(bs) to a
+// descriptor, then the blocks, then a commit block.
+struct logtag {
+  uint block;
+  uint dev;
+};
+
+struct logdesc {
+  uint magic;
+  uint seq;
+  uint n;           // blocks in the whole transaction
+  struct logtag tag[];
+};
+
+#define DESCTAGS(bs) (((bs) - sizeof(struct logdesc)) / sizeof(struct logtag))
+
+// Log blocks taken up by a transaction of n blocks.
+#define TRANSBLOCKS(n, bs) (((n) + DESCTAGS(bs) - 1) / DESCTAGS(bs) + (n) + 1)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
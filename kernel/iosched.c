@@ -0,0 +1,299 @@
+// I/O scheduler, between the buffer cache and the disk driver.
+//
+// The buffer cache hands each buf it wants read or written to
+// iosubmit().  Normally the buf goes straight to the driver
+// for its device, found in bdevsw.
+// A process that is about to start a batch of I/O can plug
+// first, with ioplug(); until the matching iounplug(), the
+// bufs it submits are kept, sorted by block number, on a
+// per-process plug list.  Unplugging sends the list to the
+// driver, merging each run of adjacent blocks going the same
+// way (up to MAXMERGE of them) into one multi-block request.
+//
+// The bufs on a plug list are locked and will not finish until
+// the list is flushed, so a plugged process must not wait for
+// anything that another process might need one of them for.
+// bwait() flushes the plug list before it sleeps, since the
+// buf it waits for may be on it.
+//
+// Drivers finish each request by handing its chain of bufs to
+// iodone(), which keeps the per-device statistics that the
+// iostat() system call reports.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "file.h"
+#include "memlayout.h"
+#include "iostat.h"
+
+// Latency histograms have a bucket for each power of two
+// microseconds.
+#define NLAT NIOLAT
+
+#define NIOSTAT 8  // devices with statistics
+
+struct devstat {
+  int used;
+  uint64 busystart;  // iotime() when inflight last became nonzero
+  struct iostat st;
+};
+
+struct {
+  struct spinlock lock;
+  struct devstat dev[NIOSTAT];
+  // dispatch-to-wakeup latency of waits for the disk,
+  // indexed by 0 for sleeping, 1 for polling.
+  uint lat[2][NLAT];
+} iosched;
+
+void
+ioinit(void)
+{
+  initlock(&iosched.lock, "iosched");
+}
+
+// Find the statistics for dev, allocating them if need be.
+// Returns 0 if the table is full.
+// Caller holds iosched.lock.
+static struct devstat*
+getstat(uint dev)
+{
+  struct devstat *ds, *empty = 0;
+
+  for(ds = iosched.dev; ds < &iosched.dev[NIOSTAT]; ds++){
+    if(ds->used && ds->st.dev == dev)
+      return ds;
+    if(!ds->used && empty == 0)
+      empty = ds;
+  }
+  if(empty){
+    memset(empty, 0, sizeof(*empty));
+    empty->used = 1;
+    empty->st.dev = dev;
+  }
+  return empty;
+}
+
+// The log2 histogram bucket for t CLINT_MTIME cycles.
+static int
+latbucket(uint64 t)
+{
+  int i;
+
+  t /= MTIME_PER_USEC;
+  for(i = 0; i < NLAT-1 && t >= 2; i++)
+    t /= 2;
+  return i;
+}
+
+// Send b, the first of a chain of n bufs for adjacent
+// blocks linked through qnext, to the driver.
+static void
+dispatch(struct buf *b, int n)
+{
+  int write = b->write;
+  int maj = major(b->dev);
+  uint64 t = iotime();
+  struct buf *bb;
+  struct devstat *ds;
+
+  if(maj < 0 || maj >= NDEV || bdevsw[maj].rw == 0)
+    panic("iosubmit: no driver");
+
+  for(bb = b; bb; bb = bb->qnext)
+    bb->tstart = t;
+
+  acquire(&iosched.lock);
+  if((ds = getstat(b->dev)) != 0){
+    if(ds->st.inflight++ == 0)
+      ds->busystart = t;
+    ds->st.nmerge[write] += n - 1;
+  }
+  release(&iosched.lock);
+
+  bdevsw[maj].rw(b, write);
+}
+
+// Called by a driver when the request that starts with buf b
+// has finished: account for it, then hand each buf in the
+// chain back to the buffer cache.
+void
+iodone(struct buf *b)
+{
+  uint64 t = iotime();
+  struct devstat *ds;
+  struct buf *next;
+  int n;
+
+  n = 0;
+  for(next = b; next; next = next->qnext)
+    n++;
+
+  acquire(&iosched.lock);
+  if((ds = getstat(b->dev)) != 0 && ds->st.inflight > 0){
+    ds->st.nreq[b->write]++;
+    ds->st.nblock[b->write] += n;
+    ds->st.lat[b->write][latbucket(t - b->tstart)]++;
+    if(--ds->st.inflight == 0)
+      ds->st.busy += t - ds->busystart;
+  }
+  release(&iosched.lock);
+
+  for(; b; b = next){
+    // once bdone() is called b may be reused,
+    // so unlink it first.
+    next = b->qnext;
+    b->qnext = 0;
+    bdone(b);
+  }
+}
+
+// Start reading or writing locked buf b.
+void
+iosubmit(struct buf *b, int write)
+{
+  struct proc *p = myproc();
+  struct buf **pb;
+
+  b->write = write;
+  b->qnext = 0;
+  if(p == 0 || p->plugged == 0){
+    dispatch(b, 1);
+    return;
+  }
+
+  // Insert in (dev, write, blockno) order.
+  for(pb = &p->plug; *pb; pb = &(*pb)->qnext){
+    if((*pb)->dev > b->dev ||
+       ((*pb)->dev == b->dev && (*pb)->write > write) ||
+       ((*pb)->dev == b->dev && (*pb)->write == write &&
+        (*pb)->blockno > b->blockno))
+      break;
+  }
+  b->qnext = *pb;
+  *pb = b;
+}
+
+// Hold back this process's I/O until iounplug().
+// Plugs nest.
+void
+ioplug(void)
+{
+  myproc()->plugged++;
+}
+
+void
+iounplug(void)
+{
+  struct proc *p = myproc();
+
+  if(p->plugged < 1)
+    panic("iounplug");
+  if(--p->plugged == 0)
+    ioflush();
+}
+
+// Send this process's plugged I/O to the driver,
+// merging adjacent blocks.
+void
+ioflush(void)
+{
+  struct proc *p = myproc();
+  struct buf *head, *b, *next;
+  int n;
+
+  if(p == 0)
+    return;
+  head = p->plug;
+  p->plug = 0;
+  while(head){
+    b = head;
+    n = 1;
+    while(n < MAXMERGE && (next = b->qnext) != 0 &&
+          next->dev == b->dev && next->write == b->write &&
+          next->blockno == b->blockno + 1){
+      b = next;
+      n++;
+    }
+    next = b->qnext;
+    b->qnext = 0;
+    dispatch(head, n);
+    head = next;
+  }
+}
+
+// The time, in CLINT_MTIME cycles.
+uint64
+iotime(void)
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
+// Record how long a wait for the disk took from dispatch,
+// and whether it was satisfied by polling.
+void
+iolatency(int polled, uint64 t)
+{
+  int i = latbucket(t);
+
+  acquire(&iosched.lock);
+  iosched.lat[polled][i]++;
+  release(&iosched.lock);
+}
+
+// Copy the statistics of the i'th device that has done I/O
+// to user address addr.
+int
+iostat(int i, uint64 addr)
+{
+  struct iostat st;
+  struct devstat *ds;
+
+  if(i < 0 || i >= NIOSTAT)
+    return -1;
+  ds = &iosched.dev[i];
+  acquire(&iosched.lock);
+  if(!ds->used){
+    release(&iosched.lock);
+    return -1;
+  }
+  st = ds->st;
+  if(st.inflight > 0)
+    st.busy += iotime() - ds->busystart;
+  release(&iosched.lock);
+  st.busy /= MTIME_PER_USEC;
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Print per-device statistics and latency histograms.  For ^P;
+// no lock, to avoid wedging a stuck machine further.
+void
+iodump(void)
+{
+  struct devstat *ds;
+  int i;
+
+  for(ds = iosched.dev; ds < &iosched.dev[NIOSTAT]; ds++){
+    if(!ds->used)
+      continue;
+    printf("dev %d,%d: %d blocks read in %d requests, %d written in %d requests, %d in flight\n",
+           major(ds->st.dev), minor(ds->st.dev),
+           (int)ds->st.nblock[0], (int)ds->st.nreq[0],
+           (int)ds->st.nblock[1], (int)ds->st.nreq[1], ds->st.inflight);
+  }
+  virtio_disk_dump();
+  printf("wait usec: sleep poll\n");
+  for(i = 0; i < NLAT; i++){
+    if(iosched.lat[0][i] || iosched.lat[1][i])
+      printf("  <%d: %d %d\n", 2 << i, iosched.lat[0][i], iosched.lat[1][i]);
+  }
+}
@@ -0,0 +1,14 @@
+// Per-device block I/O statistics, returned by iostat().
+
+#define NIOLAT 20  // latency buckets, one per power of two usec
+
+struct iostat {
+  uint dev;               // device number
+  uint inflight;          // requests at the device now
+  // indexed by 0 for reads, 1 for writes.
+  uint64 nreq[2];         // requests completed
+  uint64 nblock[2];       // blocks transferred
+  uint64 nmerge[2];       // blocks merged into another's request
+  uint64 busy;            // usec with at least one request in flight
+  uint lat[2][NIOLAT];    // request latency, dispatch to completion
+};
@@ -4,206 +4,956 @@
 #include "param.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only commits a transaction when
+// none of its FS system calls are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// end_op() waits until the transaction the call joined
+// has committed, if the call wrote anything.  A call that may write more than
+// MAXOPBLOCKS blocks says how many with begin_opn().
+//
+// Commits are done by a kernel thread, as soon as the last
+// call in the transaction ends, so every call that ended while
+// others were still running shares one commit with them
+// (group commit).  So that a steady stream of overlapping
+// calls can't put a commit off forever, a transaction stops
+// admitting new calls once it is COMMITTICKS old or it is
+// close to the largest transaction the log allows;
+// begin_op() then sleeps until its commit starts.
+//
+// New calls need not wait for a commit to finish.  The commit
+// thread first copies the committing transaction's blocks
+// from the cache into log buffers, which is quick, and only
+// then lets new calls begin, in a new transaction; they may
+// change those blocks while the copies go to disk.
+//
+// Committing only appends the transaction to the log.  Its
+// blocks stay pinned in the buffer cache, and a second
+// kernel thread later checkpoints them: it copies each
+// block from the log to its home location, then frees that
+// part of the log.  Checkpoints run once the log is half
+// full, or when begin_op() finds too little free space.
+//
+// In write-back mode (SB_WRITEBACK on the root file system),
+// end_op() doesn't wait for the commit, and the commit thread
+// lets a transaction admit calls for up to FLUSHTICKS before
+// committing it, unless it fills up or log_force() is called.
+// fsync() and friends call log_force() to wait for the
+// transactions that changed a file.
+//
+// In ordered mode (MNT_ORDERED), file data doesn't go through
+// the log: writei() hands data blocks to log_ordered() instead
+// of log_write(), and the commit thread writes them to their
+// home locations before the commit block, so that committed
+// metadata never points to data that isn't on disk.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
-struct logheader {
+// It lives on the root device, but holds blocks of every
+// mounted file system, so each entry names the device too.
+// Blocks of a device whose contents don't outlive a reboot,
+// like the ramdisk, aren't logged but written straight away:
+// after a crash there is nothing for the log to restore.
+// mkfs chooses its size.  The on-disk log format:
+//   log super block, with the position and sequence number
+//     of the oldest transaction not yet checkpointed
+//   a circular area of transactions, each of which is
+//     descriptor blocks, containing (dev, block #)s for A, B, ...
+//     block A
+//     block B
+//     ...
+//     commit block, with a checksum of all of the above
+// The whole transaction is written at once, as one run of
+// adjacent blocks: rather than wrap around the end of the log,
+// a transaction that doesn't fit there goes at the start.  It
+// has committed once all of it is on disk, which recovery can
+// tell from the checksum.  Recovery replays transactions from the log super
+// block's position for as long as each holds the next
+// sequence number and a good checksum.
+
+#define DESCMAGIC   0x4c4f4731  // in a descriptor block
+#define COMMITMAGIC 0x4c4f4732  // in a commit block
+
+// The log super block.
+struct logsuper {
+  uint seq;  // sequence number of the oldest transaction
+  uint pos;  // its position in the circular area
+};
+
+// Descriptor blocks (struct logdesc, in fs.h) list the
+// blocks of a transaction, NDESC to a descriptor.
+#define NDESC DESCTAGS(bsize)
+
+struct logcommit {
+  uint magic;
+  uint seq;
+  uint n;
+  uint sum;         // crc32 of the descriptors and blocks
+};
+
+// A block in a transaction in memory.
+struct logent {
+  uint dev;
+  uint block;
+  struct buf *buf;   // the pinned cached block
+  struct buf *lbuf;  // its log buffer, while committing
+};
+
+// Entries in a page; the most blocks in a transaction.
+#define MAXTRANS  (PGSIZE / sizeof(struct logent))
+#define NDESCBLK  ((MAXTRANS + DESCTAGS(MINBSIZE) - 1) / DESCTAGS(MINBSIZE))
+
+// The most ordered data blocks in a transaction.
+#define MAXORD    (PGSIZE / sizeof(struct buf *))
+
+// A transaction in memory.
+struct trans {
+  uint seq;
+  int pos;              // position of its first block in the log
+  int len;              // log blocks it takes up, with any it skipped
   int n;
-  int block[LOGSIZE];
+  struct logent *ent;   // a kalloc()ed page of n entries
+};
+
+// Blocks freed by the running transaction, to be discarded
+// once it has committed, as ranges [start, start+n) on dev.
+// Discarding is only advice to the disk, so a block that
+// doesn't fit is just not discarded.
+struct discard {
+  uint dev;
+  uint start;
+  uint n;
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the circular area
+  int maxtrans;    // most blocks in one transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they may yet add to the transaction
+  int freezing;    // copying blocks for commit, please wait.
+  int closed;      // transaction admits no more FS sys calls.
+  int nops;        // FS sys calls that joined the transaction.
+  uint opened;     // ticks when the first of them joined.
+  uint64 seq;      // number of the transaction being built.
+  uint64 committed; // number of the last committed transaction.
+  uint64 forced;   // someone is waiting for this one to commit.
+  int writeback;   // end_op() doesn't wait for commits.
   int dev;
-  struct logheader lh;
+  struct trans run; // the transaction being built
+  struct trans com; // the transaction being committed
+  int comblocks;   // log blocks it takes up, like trans.len
+  // ordered data blocks of the running and committing
+  // transactions, each in a kalloc()ed page.
+  int nord;
+  struct buf **ord;
+  int ncomord;
+  struct buf **comord;
+  // committed transactions not yet checkpointed, oldest
+  // first, at trans[ttail], trans[ttail+1], ...
+  int ntrans;
+  int ttail;
+  struct trans trans[NTRANS];
+  int tail;        // position of the oldest one in the log
+  int used;        // log blocks they take up
+  uint dseq;       // sequence number for the next one
+  int ckwant;      // someone is waiting for a checkpoint
+  int ndiscard;
+  struct discard discard[NDISCARD];
+  int ncomdiscard;  // blocks freed by the committing transaction
+  struct discard comdiscard[NDISCARD];
 };
 struct log log;
 
+// Blocks are checkpointed, and replayed by recovery, in
+// batches of up to CKPTBATCH.
+#define CKPTBATCH (2*MAXMERGE)
+
+static struct {
+  int n;
+  int pos[CKPTBATCH];        // where the block is in the log
+  uint dev[CKPTBATCH];       // and where it goes
+  uint block[CKPTBATCH];
+  struct buf *lbuf[CKPTBATCH];
+  struct buf *dbuf[CKPTBATCH];
+  struct buf home[CKPTBATCH];
+} ckpt;
+
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
+static void checkpointer(void);
+
+// Log blocks taken up by a transaction of n blocks.
+static int
+transblocks(int n)
+{
+  return TRANSBLOCKS(n, bsize);
+}
+
+// Log blocks the next transaction to commit after the
+// committing one would take up, if it had n blocks: those
+// skipped at the end of the log if it doesn't fit there,
+// and its own.
+static int
+nextblocks(int n)
+{
+  int head = (log.tail + log.used + log.comblocks) % log.size;
+  int len = transblocks(n);
+
+  if (head + len > log.size)
+    len += log.size - head;
+  return len;
+}
+
+static void
+transinit(struct trans *t)
+{
+  if((t->ent = (struct logent *)kalloc()) == 0)
+    panic("initlog: kalloc");
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  int i;
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
   log.dev = dev;
+  log.seq = 1;
+  log.writeback = (sb->flags & SB_WRITEBACK) != 0;
+
+  // Leave room for a committing and a running transaction.
+  log.maxtrans = MAXTRANS;
+  while (log.maxtrans > 0 && transblocks(log.maxtrans) > log.size/2)
+    log.maxtrans--;
+  if (log.maxtrans < MAXOPBLOCKS || log.maxtrans < WRITEBLOCKS(1))
+    panic("initlog: log too small");
+
+  transinit(&log.run);
+  transinit(&log.com);
+  if((log.ord = (struct buf **)kalloc()) == 0 ||
+     (log.comord = (struct buf **)kalloc()) == 0)
+    panic("initlog: kalloc");
+  for (i = 0; i < NTRANS; i++)
+    transinit(&log.trans[i]);
+
   recover_from_log();
+  kthread(committer, "commit");
+  kthread(checkpointer, "checkpoint");
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(void)
+// The most blocks one FS system call may ask begin_opn() for.
+int
+log_maxop(void)
 {
-  int tail;
+  return log.maxtrans;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+// The disk block at position pos of the circular area.
+static int
+logblock(int pos)
+{
+  return log.start + 1 + pos % log.size;
+}
+
+// The crc32 of p[0..n-1], continuing from crc.
+static uint
+crc32(uint crc, uchar *p, int n)
+{
+  static const uint tab[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+  };
+
+  crc = ~crc;
+  while (n-- > 0) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ tab[crc & 15];
+    crc = (crc >> 4) ^ tab[crc & 15];
   }
+  return ~crc;
 }
 
-// Read the log header from disk into the in-memory log header
+// Write the log super block, saying that the oldest
+// transaction in the log is the one numbered seq at pos.
 static void
-read_head(void)
+write_super(uint seq, int pos)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+
+  ls->seq = seq;
+  ls->pos = pos;
+  bwrite_async(buf);
+  bwaitpoll(buf);
+  brelse(buf);
+}
+
+// Read the transaction numbered seq at pos into t.
+// Returns 0 if there is no committed transaction there.
+static int
+read_trans(int pos, uint seq, struct trans *t)
+{
+  struct buf *buf;
+  struct logdesc *ld;
+  struct logcommit *lc;
+  uint n, sum;
+  int nd, i, j, ok;
+
+  buf = bread(log.dev, logblock(pos));
+  ld = (struct logdesc *) (buf->data);
+  n = ld->n;
+  ok = ld->magic == DESCMAGIC && ld->seq == seq && n <= MAXTRANS;
+  brelse(buf);
+  if (!ok)
+    return 0;
+
+  nd = (n + NDESC - 1) / NDESC;
+  ioplug();
+  for (i = 1; i < transblocks(n); i++)
+    breadahead(log.dev, logblock(pos + i));
+  iounplug();
+
+  sum = 0;
+  for (i = 0; i < n; i += NDESC) {
+    buf = bread(log.dev, logblock(pos + i/NDESC));
+    ld = (struct logdesc *) (buf->data);
+    ok = ld->magic == DESCMAGIC && ld->seq == seq && ld->n == n;
+    for (j = 0; ok && j < NDESC && i+j < n; j++) {
+      t->ent[i+j].block = ld->tag[j].block;
+      t->ent[i+j].dev = ld->tag[j].dev;
+    }
+    sum = crc32(sum, buf->data, bsize);
+    brelse(buf);
+    if (!ok)
+      return 0;
   }
+  for (i = 0; i < n; i++) {
+    buf = bread(log.dev, logblock(pos + nd + i));
+    sum = crc32(sum, buf->data, bsize);
+    brelse(buf);
+  }
+
+  buf = bread(log.dev, logblock(pos + nd + n));
+  lc = (struct logcommit *) (buf->data);
+  ok = lc->magic == COMMITMAGIC && lc->seq == seq && lc->n == n && lc->sum == sum;
   brelse(buf);
+  if (!ok)
+    return 0;
+
+  t->seq = seq;
+  t->pos = pos;
+  t->n = n;
+  return 1;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy a batch of blocks from the log to their home
+// locations.  When recovering, nothing else is using the
+// file system, so go through the cache; otherwise the cached
+// copy may be newer, so leave it alone.
 static void
-write_head(void)
+ckpt_flush(int recovering)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  // Start all the reads, then all the writes, so the disk
+  // sees the whole batch at once, merged where blocks are
+  // adjacent.
+  ioplug();
+  for (i = 0; i < ckpt.n; i++) {
+    ckpt.lbuf[i] = bread_async(log.dev, logblock(ckpt.pos[i])); // read log block
+    if (recovering)
+      ckpt.dbuf[i] = bread_async(ckpt.dev[i], ckpt.block[i]); // read dst
   }
-  bwrite(buf);
-  brelse(buf);
+  iounplug();
+  ioplug();
+  for (i = 0; i < ckpt.n; i++) {
+    bwait(ckpt.lbuf[i]);
+    if (recovering) {
+      bwait(ckpt.dbuf[i]);
+      memmove(ckpt.dbuf[i]->data, ckpt.lbuf[i]->data, bsize);  // copy block to dst
+      bwrite_async(ckpt.dbuf[i]);  // write dst to disk
+    } else {
+      bwrite_to(ckpt.lbuf[i], &ckpt.home[i], ckpt.dev[i], ckpt.block[i]);
+    }
+  }
+  iounplug();
+  for (i = 0; i < ckpt.n; i++) {
+    if (recovering) {
+      bwait(ckpt.dbuf[i]);
+      brelse(ckpt.dbuf[i]);
+    } else {
+      bwait(&ckpt.home[i]);
+    }
+    brelse(ckpt.lbuf[i]);
+  }
+  ckpt.n = 0;
+}
+
+// Add block i of t to the batch for ckpt_flush().
+static void
+ckpt_add(struct trans *t, int i, int recovering)
+{
+  ckpt.pos[ckpt.n] = t->pos + (t->n + NDESC - 1) / NDESC + i;
+  ckpt.dev[ckpt.n] = t->ent[i].dev;
+  ckpt.block[ckpt.n] = t->ent[i].block;
+  if (++ckpt.n == CKPTBATCH)
+    ckpt_flush(recovering);
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf = bread(log.dev, log.start);
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+  int pos, i, skipped;
+
+  log.dseq = ls->seq;
+  pos = ls->pos % log.size;
+  brelse(buf);
+
+  // if committed, copy from log to disk.  a device that
+  // was mounted before the crash may be gone now, or, like
+  // the ramdisk, not hold what it did; skip its blocks.
+  skipped = 0;
+  for (;;) {
+    if (!read_trans(pos, log.dseq, &log.run)) {
+      // it may be at the start, if it didn't fit at the end.
+      if (pos == 0 || !read_trans(0, log.dseq, &log.run))
+        break;
+      pos = 0;
+    }
+    for (i = 0; i < log.run.n; i++) {
+      if (bdevopen(log.run.ent[i].dev) && !bnolog(log.run.ent[i].dev))
+        ckpt_add(&log.run, i, 1);
+      else
+        skipped++;
+    }
+    ckpt_flush(1);
+    pos = (pos + transblocks(log.run.n)) % log.size;
+    log.dseq++;
+  }
+  if (skipped > 0)
+    printf("log: skipped %d blocks of devices that are gone\n", skipped);
+  log.run.n = 0;
+  log.tail = pos;
+  log.used = 0;
+  write_super(log.dseq, pos); // clear the log
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call
+// that may write up to n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > log.maxtrans)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.freezing || log.closed){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.run.n + log.reserved + n > log.maxtrans){
+      // this op might make the transaction too big; wait for commit.
+      log.closed = 1;
+      sleep(&log, &log.lock);
+    } else if(log.used + log.comblocks +
+              nextblocks(log.run.n + log.reserved + n) > log.size){
+      // this op might exhaust log space; wait for a checkpoint.
+      log.ckwant = 1;
+      wakeup(&log.ntrans);
+      sleep(&log, &log.lock);
+    } else if(log.nops > 0 &&
+              ticks - log.opened >= (log.writeback ? FLUSHTICKS : COMMITTICKS)){
+      // the transaction has been open long enough.
+      log.closed = 1;
       sleep(&log, &log.lock);
     } else {
+      if(log.nops++ == 0)
+        log.opened = ticks;
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->opblocks = n;
+      myproc()->opwrote = 0;
+      myproc()->oplogged = 0;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// waits for the transaction to commit, unless the call
+// changed nothing.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  uint64 seq;
 
   acquire(&log.lock);
+  seq = log.seq;
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  log.reserved -= myproc()->opblocks;
+  if(log.freezing)
+    panic("log.freezing");
+  if(log.outstanding == 0)
+    wakeup(&log.outstanding);  // the commit thread
+  while(myproc()->opwrote && !log.writeback && log.committed < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// Whether the FS call may add n more blocks to the
+// transaction without going over its reservation.
+int
+log_room(int n)
+{
+  struct proc *p = myproc();
+
+  return p->oplogged + n <= p->opblocks;
+}
+
+// Let the transaction the FS call has joined commit, and go on
+// in a new one with the same reservation.  For a call that must
+// log more blocks than a transaction holds, in pieces that each
+// leave the file system consistent.  The call must not hold
+// locks that another call in the transaction may wait for.
+void
+log_split(void)
+{
+  int n = myproc()->opblocks;
+
+  end_op();
+  begin_opn(n);
+}
+
+// The number of the transaction that FS calls are joining.
+uint64
+log_seq(void)
+{
+  uint64 seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  return seq;
+}
+
+// Wait until the transaction numbered seq, and so every
+// one before it, has committed.
+void
+log_force(uint64 seq)
+{
+  acquire(&log.lock);
+  if(seq == log.seq && log.nops == 0)
+    seq--;  // nothing has joined it yet
+  if(seq > log.forced)
+    log.forced = seq;
+  wakeup(&log.outstanding);
   release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+  // the commit thread may be waiting for a clock tick.
+  acquire(&tickslock);
+  wakeup(&ticks);
+  release(&tickslock);
+
+  acquire(&log.lock);
+  while(log.committed < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// In write-back mode, whether the running transaction
+// should wait for more calls rather than commit now.
+// Caller holds log.lock.
+static int
+holdopen(void)
+{
+  return log.writeback && !log.closed && !log.ckwant &&
+    log.forced < log.seq && ticks - log.opened < FLUSHTICKS;
+}
+
+// Fill locked log buffers for t: the descriptors desc[],
+// copies of its blocks from the cache, and the commit
+// block *cb.
+static void
+copy_out(struct trans *t, struct buf **desc, struct buf **cb)
+{
+  struct logdesc *ld;
+  struct logcommit *lc;
+  int nd, i, tail;
+  uint sum;
+
+  nd = (t->n + NDESC - 1) / NDESC;
+
+  // Every log block is overwritten, so none need be read.
+  for (i = 0; i < nd; i++)
+    desc[i] = bclaim(log.dev, logblock(t->pos+i));
+  for (tail = 0; tail < t->n; tail++)
+    t->ent[tail].lbuf = bclaim(log.dev, logblock(t->pos+nd+tail)); // log block
+  *cb = bclaim(log.dev, logblock(t->pos+nd+t->n));
+
+  sum = 0;
+  for (i = 0; i < nd; i++) {
+    ld = (struct logdesc *) (desc[i]->data);
+    memset(ld, 0, bsize);
+    ld->magic = DESCMAGIC;
+    ld->seq = t->seq;
+    ld->n = t->n;
+    for (tail = i*NDESC; tail < t->n && tail < (i+1)*NDESC; tail++) {
+      ld->tag[tail - i*NDESC].block = t->ent[tail].block;
+      ld->tag[tail - i*NDESC].dev = t->ent[tail].dev;
+    }
+    sum = crc32(sum, desc[i]->data, bsize);
+  }
+  for (tail = 0; tail < t->n; tail++) {
+    struct buf *to = t->ent[tail].lbuf;
+    struct buf *from = bread(t->ent[tail].dev, t->ent[tail].block); // cache block
+    memmove(to->data, from->data, bsize);
+    brelse(from);
+    sum = crc32(sum, to->data, bsize);
+  }
+  lc = (struct logcommit *) ((*cb)->data);
+  memset(lc, 0, bsize);
+  lc->magic = COMMITMAGIC;
+  lc->seq = t->seq;
+  lc->n = t->n;
+  lc->sum = sum;
+}
+
+// Write the log buffers filled by copy_out() to disk, and the
+// committing transaction's ordered data to its home locations.
+// Once they are all there, t has committed.
+static void
+write_log(struct trans *t, struct buf **desc, struct buf *cb)
+{
+  int nd, i, tail;
+  struct buf *b;
+
+  // The blocks are adjacent, so when plugged they go to the
+  // disk as a few large requests, started together.
+  nd = (t->n + NDESC - 1) / NDESC;
+  ioplug();
+  for (i = 0; i < log.ncomord; i++)
+    bwrite_async(log.comord[i]);  // locked by lock_ordered()
+  for (i = 0; i < nd; i++)
+    bwrite_async(desc[i]);
+  for (tail = 0; tail < t->n; tail++)
+    bwrite_async(t->ent[tail].lbuf);  // write the log
+  if (log.ncomord > 0) {
+    // The ordered data must be home before the commit
+    // block is written.
+    iounplug();
+    for (i = 0; i < log.ncomord; i++) {
+      b = log.comord[i];
+      bwaitpoll(b);
+      brelse(b);
+      bunpin(b);
+    }
+    log.ncomord = 0;
+    ioplug();
+  }
+  bwrite_async(cb);
+  iounplug();
+  // The commit waits for these writes; poll for them.
+  for (i = 0; i < nd; i++) {
+    bwaitpoll(desc[i]);
+    brelse(desc[i]);
+  }
+  for (tail = 0; tail < t->n; tail++) {
+    bwaitpoll(t->ent[tail].lbuf);
+    brelse(t->ent[tail].lbuf);
+  }
+  bwaitpoll(cb);
+  brelse(cb);
+}
+
+// Tell the disks about the blocks the committed transaction
+// freed, now that they are free for good.
+static void
+discard_freed(void)
+{
+  int i;
+
+  for (i = 0; i < log.ncomdiscard; i++)
+    bdiscard(log.comdiscard[i].dev, log.comdiscard[i].start,
+             log.comdiscard[i].n);
+  log.ncomdiscard = 0;
+}
+
+// Make the running transaction's ordered data the committing
+// one's, but for any block the transaction also logged: the
+// log has it, and writing it home would get ahead of the
+// commit.  Caller holds log.lock.
+static void
+swapord(void)
+{
+  struct buf **ord;
+  int i;
+
+  ord = log.comord;
+  log.comord = log.ord;
+  log.ord = ord;
+  log.ncomord = 0;
+  for (i = 0; i < log.nord; i++) {
+    if (log.comord[i]->logged > 0)
+      bunpin(log.comord[i]);
+    else
+      log.comord[log.ncomord++] = log.comord[i];
+  }
+  log.nord = 0;
+}
+
+// Lock the committing transaction's ordered data blocks, while
+// no FS calls are running, and so hold on to what they had
+// when it closed: the running transaction may free and reuse
+// them, or write them again, but not until they are home.
+static void
+lock_ordered(void)
+{
+  int i;
+
+  for (i = 0; i < log.ncomord; i++)
+    if (bread(log.comord[i]->dev, log.comord[i]->blockno) != log.comord[i])
+      panic("lock_ordered");  // pinned, so cached
+}
+
+// Write the committing transaction's ordered data home, for a
+// transaction that logged nothing.
+static void
+write_ordered(void)
+{
+  struct buf *b;
+  int i;
+
+  ioplug();
+  for (i = 0; i < log.ncomord; i++)
+    bwrite_async(log.comord[i]);  // locked by lock_ordered()
+  iounplug();
+  for (i = 0; i < log.ncomord; i++) {
+    b = log.comord[i];
+    bwaitpoll(b);
+    brelse(b);
+    bunpin(b);
+  }
+  log.ncomord = 0;
+}
+
+// The commit thread: commit each transaction once the
+// FS system calls in it have all finished.
+static void
+committer(void)
+{
+  uint64 seq;
+  struct logent *ent;
+  struct buf *desc[NDESCBLK], *cb = 0;
+
+  acquire(&log.lock);
+  for(;;){
+    if(log.nops == 0 || log.outstanding > 0){
+      sleep(&log.outstanding, &log.lock);
+      continue;
+    }
+    if(log.run.n == 0 && log.nord == 0 && log.ndiscard == 0){
+      // the calls changed nothing, so there is nothing to
+      // write; just start a new transaction.
+      log.committed = log.seq++;
+      log.nops = 0;
+      log.closed = 0;
+      wakeup(&log);
+      continue;
+    }
+    if(holdopen()){
+      // check again on the next clock tick.
+      release(&log.lock);
+      acquire(&tickslock);
+      if(log.forced < log.seq)
+        sleep(&ticks, &tickslock);
+      release(&tickslock);
+      acquire(&log.lock);
+      continue;
+    }
+    if(log.ntrans == NTRANS){
+      // no room to remember another committed transaction.
+      log.ckwant = 1;
+      wakeup(&log.ntrans);
+      sleep(&log, &log.lock);
+      continue;
+    }
+
+    // Take the transaction out of the way of new calls,
+    // swapping entry pages with the last committed one.
+    seq = log.seq++;
+    ent = log.com.ent;
+    log.com = log.run;
+    log.run.ent = ent;
+    log.run.n = 0;
+    swapord();
+    log.com.seq = log.dseq;
+    log.comblocks = 0;
+    if(log.com.n > 0){
+      log.comblocks = nextblocks(log.com.n);
+      log.com.pos = (log.tail + log.used + log.comblocks -
+                     transblocks(log.com.n)) % log.size;
+    }
+    log.com.len = log.comblocks;
+    memmove(log.comdiscard, log.discard, log.ndiscard * sizeof(struct discard));
+    log.ncomdiscard = log.ndiscard;
+    log.ndiscard = 0;
+    log.nops = 0;
+    log.closed = 0;
+    log.freezing = 1;
+    release(&log.lock);
+
+    // call copy_out() and so on w/o holding locks, since
+    // not allowed to sleep with locks.
+    if (log.com.n > 0)
+      copy_out(&log.com, desc, &cb);
+    lock_ordered();
+
     acquire(&log.lock);
-    log.committing = 0;
+    log.freezing = 0;
     wakeup(&log);
     release(&log.lock);
+
+    if (log.com.n > 0)
+      write_log(&log.com, desc, cb);  // Write the transaction -- the real commit
+    else
+      write_ordered();
+    discard_freed();
+
+    acquire(&log.lock);
+    if(log.com.n > 0){
+      struct trans *t = &log.trans[(log.ttail + log.ntrans) % NTRANS];
+      ent = t->ent;
+      *t = log.com;
+      log.com.ent = ent;
+      log.ntrans++;
+      log.used += log.comblocks;
+      log.dseq++;
+      if(log.used*2 > log.size || log.ckwant)
+        wakeup(&log.ntrans);  // the checkpoint thread
+    }
+    log.comblocks = 0;
+    log.committed = seq;
+    wakeup(&log);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Does a transaction after the k'th committed one, among the
+// first nt, also have block i of the k'th?
+static int
+rewritten(int k, int i, int nt)
+{
+  struct trans *t = &log.trans[(log.ttail + k) % NTRANS];
+  struct trans *t1;
+  int j;
+
+  for (k++; k < nt; k++) {
+    t1 = &log.trans[(log.ttail + k) % NTRANS];
+    for (j = 0; j < t1->n; j++) {
+      if (t1->ent[j].buf == t->ent[i].buf)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// Write the blocks of the committed transactions home, then
+// free their space in the log.  The cached copy of a block
+// may already hold a later transaction's changes, so the
+// block is written from the log copy instead.  A block that
+// a later transaction also has is left to that one.
 static void
-write_log(void)
+checkpoint(void)
 {
-  int tail;
+  struct trans *t;
+  int nt, k, i, pos, freed;
+  uint seq;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  acquire(&log.lock);
+  nt = log.ntrans;
+  release(&log.lock);
+  if (nt == 0)
+    return;
+
+  for (k = 0; k < nt; k++) {
+    t = &log.trans[(log.ttail + k) % NTRANS];
+    for (i = 0; i < t->n; i++) {
+      if (!rewritten(k, i, nt))
+        ckpt_add(t, i, 0);
+    }
+  }
+  ckpt_flush(0);
+
+  t = &log.trans[(log.ttail + nt - 1) % NTRANS];
+  seq = t->seq + 1;
+  pos = (t->pos + transblocks(t->n)) % log.size;
+  write_super(seq, pos);
+
+  // The blocks are home, and recovery won't replay them;
+  // they may leave the cache.
+  freed = 0;
+  acquire(&log.lock);
+  for (k = 0; k < nt; k++) {
+    t = &log.trans[(log.ttail + k) % NTRANS];
+    for (i = 0; i < t->n; i++) {
+      t->ent[i].buf->logged--;
+      bunpin(t->ent[i].buf);
+    }
+    freed += t->len;
   }
+  log.ttail = (log.ttail + nt) % NTRANS;
+  log.ntrans -= nt;
+  log.used -= freed;
+  log.tail = pos;
+  wakeup(&log);
+  release(&log.lock);
 }
 
+// The checkpoint thread.
 static void
-commit()
+checkpointer(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&log.lock);
+  for(;;){
+    if(log.ntrans == 0 || (!log.ckwant && log.used*2 <= log.size)){
+      sleep(&log.ntrans, &log.lock);
+      continue;
+    }
+    log.ckwant = 0;
+    release(&log.lock);
+    checkpoint();
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The commit thread will write it to the log, and the checkpoint
+// thread to its home location.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,23 +963,117 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  struct logent *e;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
+  if (bnolog(b->dev)) {
+    bwrite(b);
+    return;
+  }
+  myproc()->opwrote = 1;
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  for (e = log.run.ent; e < &log.run.ent[log.run.n]; e++) {
+    if (e->buf == b)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (e == &log.run.ent[log.run.n]) {  // Add new block to log?
+    if (log.run.n >= log.maxtrans)
+      panic("too big a transaction");
+    bpin(b);
+    b->logged++;
+    e->dev = b->dev;
+    e->block = b->blockno;
+    e->buf = b;
+    log.run.n++;
+    myproc()->oplogged++;
+  }
+  release(&log.lock);
+}
+
+// Like log_write(), for a block of file data in ordered mode:
+// rather than go through the log, b is written to its home
+// location just before the transaction commits.  A block that
+// a transaction in the log also has is logged as usual, since
+// checkpointing or replaying that transaction would overwrite
+// the new data.
+void
+log_ordered(struct buf *b)
+{
+  if (log.outstanding < 1)
+    panic("log_ordered outside of trans");
+  myproc()->opwrote = 1;
+
+  acquire(&log.lock);
+  if (b->logged > 0 || log.nord == MAXORD) {
+    release(&log.lock);
+    log_write(b);
+    return;
+  }
+  if (b->ordseq != log.seq) {  // not already ordered in this one?
     bpin(b);
-    log.lh.n++;
+    b->ordseq = log.seq;
+    log.ord[log.nord++] = b;
+  }
+  release(&log.lock);
+}
+
+
+// Block b on dev was freed by the running transaction;
+// discard it once the transaction commits.
+void
+log_discard(uint dev, uint b)
+{
+  struct discard *d;
+
+  acquire(&log.lock);
+  for (d = log.discard; d < &log.discard[log.ndiscard]; d++) {
+    if (d->dev != dev)
+      continue;
+    if (b == d->start + d->n) {
+      d->n++;
+      break;
+    }
+    if (b + 1 == d->start) {
+      d->start--;
+      d->n++;
+      break;
+    }
+  }
+  if (d == &log.discard[log.ndiscard] && log.ndiscard < NDISCARD) {
+    d->dev = dev;
+    d->start = b;
+    d->n = 1;
+    log.ndiscard++;
   }
   release(&log.lock);
 }
 
+// Block b on dev has been allocated again;
+// it must not be discarded.
+void
+log_undiscard(uint dev, uint b)
+{
+  struct discard *d;
+  uint end;
+
+  acquire(&log.lock);
+  for (d = log.discard; d < &log.discard[log.ndiscard]; d++) {
+    if (d->dev != dev || b < d->start || b >= d->start + d->n)
+      continue;
+    end = d->start + d->n;
+    d->n = b - d->start;
+    if (b + 1 < end && log.ndiscard < NDISCARD) {
+      // keep the part after b in a new range.
+      log.discard[log.ndiscard].dev = dev;
+      log.discard[log.ndiscard].start = b + 1;
+      log.discard[log.ndiscard].n = end - (b + 1);
+      log.ndiscard++;
+    }
+    if (d->n == 0)
+      *d = log.discard[--log.ndiscard];
+    break;
+  }
+  release(&log.lock);
+}
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    ramdiskinit();   // initrd image
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -25,6 +26,7 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    ioinit();        // I/O scheduler
     iinit();         // inode cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
@@ -8,6 +8,7 @@
 // 0C000000 -- PLIC
 // 10000000 -- uart0 
 // 10001000 -- virtio disk 
+// ...         up to NVIRTIO virtio mmio slots, 0x1000 apart
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
 // unused RAM after 80000000.
@@ -16,19 +17,25 @@
 // 80000000 -- entry.S, then kernel text and data
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
+// above PHYSTOP -- ramdisk image, if qemu -initrd, where the
+//                  device tree's /chosen node says
 
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
 #define UART0_IRQ 10
 
-// virtio mmio interface
+// virtio mmio interface.  slot n is at VIRTIO(n),
+// and interrupts with IRQ VIRTIO0_IRQ + n.
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define NVIRTIO 8
+#define VIRTIO(n) (VIRTIO0 + (n)*0x1000)
 
 // local interrupt controller, which contains the timer.
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define MTIME_PER_USEC 10 // qemu's CLINT counts at 10 MHz.
 
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
@@ -4,10 +4,20 @@
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
-#define ROOTDEV       1  // device number of file system root disk
+#define ROOTDEV  mkdev(VDISK, 0)  // device number of file system root disk
+#define NMOUNT        8  // maximum number of mounted file systems
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGBLOCKS    256  // default size of on-disk log, for mkfs
+#define NTRANS       16   // max committed transactions awaiting checkpoint
+#define COMMITTICKS  1    // max age of a transaction still admitting FS ops
+#define FLUSHTICKS   30   // same, in write-back mode (SB_WRITEBACK)
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define BCACHEPCT    25    // max % of free memory used by disk block cache
+#define MAXREADAHEAD 32   // max # of blocks to read ahead of a file reader
+#define MAXMERGE     32   // max # of blocks merged into one disk request
+#define POLLUSEC     100  // max usec to poll for a disk completion
+#define DISKPOLL     0    // poll in every bwait(), not just bwaitpoll()
+#define FSSIZE       10000  // default size of file system in 1KB blocks
+#define NDISCARD     32    // max freed block ranges per transaction
 #define MAXPATH      128   // maximum file path name
@@ -103,4 +103,10 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int plugged;                 // ioplug() depth
+  struct buf *plug;            // I/O held back while plugged
+  void (*kfn)(void);           // Kernel thread's function
+  int opblocks;                // Log blocks reserved by begin_opn()
+  int opwrote;                 // FS call has logged or ordered a block
+  int oplogged;                // blocks it has added to the transaction
 };
@@ -1,5 +1,12 @@
 //
-// ramdisk that uses the disk image loaded by qemu -rdinit fs.img
+// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+//
+// qemu puts the image somewhere past the memory the kernel
+// uses, and says where in the device tree's /chosen node.
+// it must hold a file system, whose superblock says how big
+// it is, and fit in what qemu loaded.  the ramdisk is block
+// device mkdev(RAMDISK, 0), and can be mounted like a disk.
+// I/O is a memmove, finished before ramdiskrw() returns.
 //
 
 #include "types.h"
@@ -11,35 +18,162 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "file.h"
+
+static struct {
+  char *base;
+  uint64 size;     // bytes; 0 if there is no image
+} ramdisk;
+
+// flattened device tree format; all numbers are big-endian.
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+
+struct fdthdr {
+  uint magic;
+  uint totalsize;
+  uint off_struct;   // node and property tokens
+  uint off_strings;  // property names
+};
+
+static uint
+be32(void *p)
+{
+  uchar *b = p;
+
+  return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+// a property value of one or two cells.
+static uint64
+becells(uchar *p, uint len)
+{
+  if(len == 8)
+    return ((uint64)be32(p) << 32) | be32(p + 4);
+  return be32(p);
+}
+
+// find where qemu -initrd put the image, from the
+// linux,initrd-start and -end properties of /chosen in
+// the device tree.  returns 0 if there is none.
+static int
+fdtinitrd(uint64 *start, uint64 *end)
+{
+  struct fdthdr *h = (struct fdthdr *)dtb;
+  uchar *p;
+  char *strs, *name;
+  uint len;
+  int depth, chosen;
+
+  if(h == 0 || be32(&h->magic) != FDT_MAGIC)
+    return 0;
+  p = (uchar *)h + be32(&h->off_struct);
+  strs = (char *)h + be32(&h->off_strings);
+  *start = *end = 0;
+  depth = chosen = 0;
+  for(;;){
+    switch(be32(p)){
+    case FDT_BEGIN_NODE:
+      depth++;
+      name = (char *)p + 4;
+      if(depth == 2 && strncmp(name, "chosen", 7) == 0)
+        chosen = 1;
+      p += 4 + ((strlen(name) + 1 + 3) & ~3);
+      break;
+    case FDT_END_NODE:
+      if(depth-- == 2)
+        chosen = 0;
+      p += 4;
+      break;
+    case FDT_PROP:
+      len = be32(p + 4);
+      name = strs + be32(p + 8);
+      if(chosen && depth == 2){
+        if(strncmp(name, "linux,initrd-start", 19) == 0)
+          *start = becells(p + 12, len);
+        else if(strncmp(name, "linux,initrd-end", 17) == 0)
+          *end = becells(p + 12, len);
+      }
+      p += 12 + ((len + 3) & ~3);
+      break;
+    case FDT_NOP:
+      p += 4;
+      break;
+    default:  // FDT_END
+      return *end > *start;
+    }
+  }
+}
 
+// look for an image.  called before paging is on;
+// kvminit() maps ramdisksize() bytes at ramdiskbase().
 void
 ramdiskinit(void)
 {
+  struct superblock *sb;
+  uint64 start, end;
+
+  if(!fdtinitrd(&start, &end))
+    return;
+  if(start < PHYSTOP || end - start < SBOFF + sizeof(*sb)){
+    printf("ramdisk: bad initrd %p-%p\n", start, end);
+    return;
+  }
+  sb = (struct superblock *)(start + SBOFF);
+  if(sb->magic != FSMAGIC || sb->size < 2 ||
+     sb->bsize < MINBSIZE || sb->bsize > BSIZE)
+    return;
+  if((uint64)sb->size * sb->bsize > end - start){
+    printf("ramdisk: image is bigger than the initrd\n");
+    return;
+  }
+  ramdisk.base = (char *)start;
+  ramdisk.size = (uint64)sb->size * sb->bsize;
+
+  bdevsw[RAMDISK].open = ramdiskopen;
+  bdevsw[RAMDISK].rw = ramdiskrw;
+  bdevsw[RAMDISK].nolog = 1;
+}
+
+// physical address of the image.
+uint64
+ramdiskbase(void)
+{
+  return (uint64)ramdisk.base;
+}
+
+// bytes of memory holding the image, or 0.
+uint64
+ramdisksize(void)
+{
+  return PGROUNDUP(ramdisk.size);
+}
+
+int
+ramdiskopen(int minor)
+{
+  return minor == 0 && ramdisk.size > 0;
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// read or write b, and the bufs chained to it through
+// b->qnext, which hold the blocks following b's.
 void
-ramdiskrw(struct buf *b)
-{
-  if(!holdingsleep(&b->lock))
-    panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
-    panic("ramdiskrw: blockno too big");
-
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
-
-  if(b->flags & B_DIRTY){
-    // write
-    memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
-  } else {
-    // read
-    memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
+ramdiskrw(struct buf *b, int write)
+{
+  struct buf *bb;
+
+  for(bb = b; bb; bb = bb->qnext){
+    if((uint64)(bb->blockno + 1) * bsize > ramdisk.size)
+      panic("ramdiskrw: blockno too big");
+
+    char *addr = ramdisk.base + (uint64)bb->blockno * bsize;
+    if(write)
+      memmove(addr, bb->data, bsize);
+    else
+      memmove(bb->data, addr, bsize);
   }
+  iodone(b);
 }
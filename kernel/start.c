@@ -16,10 +16,16 @@ uint64 mscratch0[NCPU * 32];
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
+// physical address of the device tree qemu made, or 0.
+uint64 dtb;
+
 // entry.S jumps here in machine mode on stack0.
 void
-start()
+start(uint64 fdt)
 {
+  // every CPU is given the same one.
+  dtb = fdt;
+
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
@@ -20,3 +20,9 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mount  22
+#define SYS_iostat 23
+#define SYS_fsync  24
+#define SYS_fdatasync 25
+#define SYS_sync   26
+#define SYS_bcachesize 27
@@ -115,6 +115,36 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// fsync(fd): make fd's file durable.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f, 0);
+}
+
+// fdatasync(fd): make fd's file data and size durable.
+uint64
+sys_fdatasync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f, 1);
+}
+
+// sync(): make every file system change so far durable.
+uint64
+sys_sync(void)
+{
+  log_force(log_seq());
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -210,7 +240,7 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && (!isdirempty(ip) || ip->mounted)){
     iunlockput(ip);
     goto bad;
   }
@@ -363,6 +393,59 @@ sys_mkdir(void)
   return 0;
 }
 
+// mount(major, minor, path, flags): mount the file system on
+// block device (major, minor) on directory path.
+uint64
+sys_mount(void)
+{
+  char path[MAXPATH];
+  int maj, min, flags;
+  struct inode *ip;
+
+  if(argint(0, &maj) < 0 || argint(1, &min) < 0 ||
+     argstr(2, path, MAXPATH) < 0 || argint(3, &flags) < 0)
+    return -1;
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  if(ip->type != T_DIR || ip->inum == ROOTINO){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+  iunlock(ip);
+  if(fsmount(mkdev(maj, min), ip, flags) < 0){
+    iput(ip);
+    end_op();
+    return -1;
+  }
+  end_op();
+  return 0;
+}
+
+// iostat(i, st): block I/O statistics of the i'th device.
+uint64
+sys_iostat(void)
+{
+  int i;
+  uint64 st;
+
+  if(argint(0, &i) < 0 || argaddr(1, &st) < 0)
+    return -1;
+  return iostat(i, st);
+}
+
+// bcachesize(): the most bytes of blocks the buffer
+// cache will hold.
+uint64
+sys_bcachesize(void)
+{
+  return bcachesize();
+}
+
 uint64
 sys_mknod(void)
 {
@@ -2,7 +2,8 @@
 // virtio device definitions.
 // for both the mmio interface, and virtio descriptors.
 // only tested with qemu.
-// this is the "legacy" virtio interface.
+// both the "legacy" (version 1) and the virtio 1.0
+// (version 2) mmio interfaces.
 //
 // the virtio spec:
 // https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf
@@ -11,22 +12,33 @@
 // virtio mmio control registers, mapped starting at 0x10001000.
 // from qemu virtio_mmio.h
 #define VIRTIO_MMIO_MAGIC_VALUE		0x000 // 0x74726976
-#define VIRTIO_MMIO_VERSION		0x004 // version; 1 is legacy
+#define VIRTIO_MMIO_VERSION		0x004 // version; 1 is legacy, 2 is virtio 1.0
 #define VIRTIO_MMIO_DEVICE_ID		0x008 // device type; 1 is net, 2 is disk
 #define VIRTIO_MMIO_VENDOR_ID		0x00c // 0x554d4551
 #define VIRTIO_MMIO_DEVICE_FEATURES	0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014 // which 32 features, write-only
 #define VIRTIO_MMIO_DRIVER_FEATURES	0x020
-#define VIRTIO_MMIO_GUEST_PAGE_SIZE	0x028 // page size for PFN, write-only
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024 // which 32 features, write-only
+#define VIRTIO_MMIO_GUEST_PAGE_SIZE	0x028 // page size for PFN, write-only, legacy
 #define VIRTIO_MMIO_QUEUE_SEL		0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX	0x034 // max size of current queue, read-only
 #define VIRTIO_MMIO_QUEUE_NUM		0x038 // size of current queue, write-only
-#define VIRTIO_MMIO_QUEUE_ALIGN		0x03c // used ring alignment, write-only
-#define VIRTIO_MMIO_QUEUE_PFN		0x040 // physical page number for queue, read/write
-#define VIRTIO_MMIO_QUEUE_READY		0x044 // ready bit
+#define VIRTIO_MMIO_QUEUE_ALIGN		0x03c // used ring alignment, write-only, legacy
+#define VIRTIO_MMIO_QUEUE_PFN		0x040 // physical page number for queue, read/write, legacy
+#define VIRTIO_MMIO_QUEUE_READY		0x044 // ready bit, version 2
 #define VIRTIO_MMIO_QUEUE_NOTIFY	0x050 // write-only
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
+// version 2 only: 64-bit physical addresses of the
+// descriptor table, avail ring and used ring, write-only.
+#define VIRTIO_MMIO_QUEUE_DESC_LOW	0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH	0x084
+#define VIRTIO_MMIO_DRIVER_DESC_LOW	0x090
+#define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
+#define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0
+#define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -39,13 +51,21 @@
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD        13	/* Supports discard */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
 
-// this many virtio descriptors.
+// the most virtio descriptors in the queue; the actual
+// size is negotiated with the device at boot.
 // must be a power of two.
-#define NUM 8
+#define NUM 256
+
+// a virtqueue of NUM descriptors.  legacy: the descriptor table
+// and avail ring, then the used ring on the next page boundary.
+// version 2: a page each for the table, avail and used rings.
+#define VRING_PAGES 3
 
 struct VRingDesc {
   uint64 addr;
@@ -55,6 +75,15 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
+
+#define VRING_USED_F_NO_NOTIFY 1 // device doesn't want notifies
+
+// with VIRTIO_RING_F_EVENT_IDX, should the driver notify the
+// device (or the device interrupt the driver) after moving an
+// index from old to new, given the event index it was sent?
+#define VRING_NEED_EVENT(event, new, old) \
+  ((uint16)((new) - (event) - 1) < (uint16)((new) - (old)))
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
@@ -64,6 +93,27 @@ struct VRingUsedElem {
 // for disk ops
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_DISCARD 11 // discard sectors
+
+// offset of max_discard_sectors in the virtio-blk
+// configuration space, which starts at VIRTIO_MMIO_CONFIG.
+#define VIRTIO_BLK_CFG_MAX_DISCARD 36
+
+// the format of the first descriptor in a disk request.
+// to be followed by two more descriptors containing
+// the block, and a one-byte status.
+struct virtio_blk_req {
+  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 reserved;
+  uint64 sector;
+};
+
+// the data of a discard request: a range of sectors.
+struct virtio_blk_discard {
+  uint64 sector;
+  uint32 num_sectors;
+  uint32 flags;
+};
 
 struct UsedArea {
   uint16 flags;
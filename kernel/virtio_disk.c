@@ -1,10 +1,15 @@
 //
 // driver for qemu's virtio disk device.
 // uses qemu's mmio interface to virtio.
-// qemu presents a "legacy" virtio interface.
+// qemu presents a "legacy" virtio interface unless
+// told -global virtio-mmio.force-legacy=false, in which
+// case it presents the virtio 1.0 interface.  we speak both.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// there may be a disk in each of the NVIRTIO mmio slots
+// (bus=virtio-mmio-bus.n); each has its own queue.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -15,24 +20,36 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "file.h"
 #include "virtio.h"
 
 // the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+#define R(d, r) ((volatile uint32 *)((d)->base + (r)))
 
 static struct disk {
  // memory for virtio descriptors &c for queue 0.
  // this is a global instead of allocated because it must
  // be multiple contiguous pages, which kalloc()
  // doesn't support, and page aligned.
-  char pages[2*PGSIZE];
+  char pages[VRING_PAGES*PGSIZE];
+  uint64 base;     // mmio registers.
+  int present;     // is there a disk in this slot?
   struct VRingDesc *desc;
   uint16 *avail;
   struct UsedArea *used;
+  uint32 num;      // queue size agreed with the device.
+  int indirect;    // VIRTIO_RING_F_INDIRECT_DESC negotiated?
+  int eventidx;    // VIRTIO_RING_F_EVENT_IDX negotiated?
+
+  // with indirect descriptors, each request's chain is in a
+  // table of its own, indexed by its ring descriptor.
+  struct VRingDesc *indir[NUM];
 
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 nextfree[NUM]; // free descriptors, linked through here.
+  uint16 freehead; // first free descriptor.
+  uint32 nfree;    // how many descriptors are free.
+  uint16 used_idx; // we've looked this far in used->elems.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -40,230 +57,535 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char done;     // for discards, which have no buf.
   } info[NUM];
+
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_req ops[NUM];
+
+  // discard ranges, likewise.
+  struct virtio_blk_discard seg[NUM];
+  int discard;     // VIRTIO_BLK_F_DISCARD negotiated?
+  uint maxdiscard; // most sectors in one discard.
+
+  uint nnotify;    // statistics: notifies sent,
+  uint nintr;      // and interrupts taken.
   
   struct spinlock vdisk_lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} __attribute__ ((aligned (PGSIZE))) disk[NVIRTIO];
+
+static void disk_init(struct disk *d, uint32 version);
 
+// look for disks in each of qemu's virtio mmio slots.
+// the disk in slot n is block device mkdev(VDISK, n).
 void
 virtio_disk_init(void)
 {
-  uint32 status = 0;
+  struct disk *d;
+  uint32 version;
+
+  for(d = disk; d < &disk[NVIRTIO]; d++){
+    initlock(&d->vdisk_lock, "virtio_disk");
+    d->base = VIRTIO(d - disk);
+    version = *R(d, VIRTIO_MMIO_VERSION);
+    if(*R(d, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+       (version != 1 && version != 2) ||
+       *R(d, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+       *R(d, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551)
+      continue;
+    disk_init(d, version);
+    d->present = 1;
+  }
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  bdevsw[VDISK].open = virtio_disk_open;
+  bdevsw[VDISK].rw = virtio_disk_rw;
+  bdevsw[VDISK].poll = virtio_disk_poll;
+  bdevsw[VDISK].discard = virtio_disk_discard;
+}
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 1 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
-  }
+// is there a disk in slot n?
+int
+virtio_disk_open(int n)
+{
+  return n >= 0 && n < NVIRTIO && disk[n].present;
+}
+
+static void
+disk_init(struct disk *d, uint32 version)
+{
+  uint32 status = 0;
+
+  // reset the device.
+  *R(d, VIRTIO_MMIO_STATUS) = status;
   
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
-
-  // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
-  features &= ~(1 << VIRTIO_BLK_F_RO);
-  features &= ~(1 << VIRTIO_BLK_F_SCSI);
-  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
-  features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
+
+  // negotiate features.  a version 2 device
+  // has more than 32; accept only the ones we use.
+  *R(d, VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
+  uint64 features = *R(d, VIRTIO_MMIO_DEVICE_FEATURES);
+  if(version == 2){
+    *R(d, VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+    features |= (uint64)*R(d, VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+  }
+  features &= (1 << VIRTIO_BLK_F_DISCARD) |
+              (1 << VIRTIO_RING_F_INDIRECT_DESC) |
+              (1 << VIRTIO_RING_F_EVENT_IDX) |
+              (1L << VIRTIO_F_VERSION_1);
+  if(version == 2 && (features & (1L << VIRTIO_F_VERSION_1)) == 0)
+    panic("virtio disk: no VERSION_1");
+  if(features & (1 << VIRTIO_BLK_F_DISCARD)){
+    // a disk that can't discard a whole block is no use.
+    d->maxdiscard = *R(d, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_MAX_DISCARD);
+    if(d->maxdiscard == 0)
+      d->maxdiscard = 0xffffffff;
+    if(d->maxdiscard < MINBSIZE / 512)
+      features &= ~(1 << VIRTIO_BLK_F_DISCARD);
+  }
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  if(version == 2){
+    *R(d, VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+  }
+  d->indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+  d->eventidx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
+  d->discard = (features & (1 << VIRTIO_BLK_F_DISCARD)) != 0;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
-
-  // tell device we're completely ready.
-  status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
-
-  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
-
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  *R(d, VIRTIO_MMIO_STATUS) = status;
+  if(version == 2 && (*R(d, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK) == 0)
+    panic("virtio disk FEATURES_OK unset");
+
+  // initialize queue 0, as large as the device and
+  // NUM allow.  split queue sizes are powers of two.
+  *R(d, VIRTIO_MMIO_QUEUE_SEL) = 0;
+  if(version == 2 && *R(d, VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk queue 0 in use");
+  uint32 max = *R(d, VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  d->num = NUM;
+  while(d->num > max)
+    d->num /= 2;
+  if(d->num < MAXMERGE+2)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  *R(d, VIRTIO_MMIO_QUEUE_NUM) = d->num;
+  memset(d->pages, 0, sizeof(d->pages));
+
+  d->desc = (struct VRingDesc *) d->pages;
+  if(version == 1){
+    // desc = pages -- num * VRingDesc
+    // avail = desc + num * VRingDesc -- 2 * uint16, then num * uint16
+    // used = next page boundary -- 2 * uint16, then num * VRingUsedElem
+    d->avail = (uint16*)(((char*)d->desc) + d->num*sizeof(struct VRingDesc));
+    d->used = (struct UsedArea *)
+      (d->pages + PGROUNDUP((uint64)(d->avail + 3 + d->num) - (uint64)d->pages));
+
+    *R(d, VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+    *R(d, VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
+    *R(d, VIRTIO_MMIO_QUEUE_PFN) = ((uint64)d->pages) >> PGSHIFT;
+  } else {
+    // each part on its own page, so that the used ring, which
+    // the device writes, shares no cache lines with the avail
+    // ring, which the driver writes.
+    d->avail = (uint16*)(d->pages + PGSIZE);
+    d->used = (struct UsedArea *) (d->pages + 2*PGSIZE);
+
+    *R(d, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)d->desc;
+    *R(d, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)d->desc >> 32;
+    *R(d, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)d->avail;
+    *R(d, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)d->avail >> 32;
+    *R(d, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)d->used;
+    *R(d, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)d->used >> 32;
+    *R(d, VIRTIO_MMIO_QUEUE_READY) = 1;
+  }
 
-  disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
-  disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
+  for(int i = 0; i < d->num; i++)
+    d->nextfree[i] = i + 1;
+  d->freehead = 0;
+  d->nfree = d->num;
+
+  if(d->indirect){
+    // a table for each ring descriptor, several to a page.
+    int sz = (MAXMERGE+2) * sizeof(struct VRingDesc);
+    char *pa = 0;
+    int left = 0;
+    for(int i = 0; i < d->num; i++){
+      if(left < sz){
+        if((pa = kalloc()) == 0)
+          panic("virtio disk indirect");
+        left = PGSIZE;
+      }
+      d->indir[i] = (struct VRingDesc *) pa;
+      pa += sz;
+      left -= sz;
+    }
+  }
 
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // tell device we're completely ready.
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // plic.c and trap.c arrange for interrupts from
+  // VIRTIO0_IRQ + the slot number.
 }
 
-// find a free descriptor, mark it non-free, return its index.
+// take the descriptor at the head of the free list.
 static int
-alloc_desc()
+alloc_desc(struct disk *d)
 {
-  for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
-      return i;
-    }
-  }
-  return -1;
+  int i;
+
+  if(d->nfree == 0)
+    panic("alloc_desc");
+  i = d->freehead;
+  d->freehead = d->nextfree[i];
+  d->nfree--;
+  return i;
 }
 
-// mark a descriptor as free.
+// put a descriptor back on the free list.
 static void
-free_desc(int i)
+free_desc(struct disk *d, int i)
 {
-  if(i >= NUM)
+  if(i >= d->num)
     panic("virtio_disk_intr 1");
-  if(disk.free[i])
+  if(d->desc[i].addr == 0)
     panic("virtio_disk_intr 2");
-  disk.desc[i].addr = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  d->desc[i].addr = 0;
+  d->nextfree[i] = d->freehead;
+  d->freehead = i;
+  d->nfree++;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct disk *d, int i)
 {
   while(1){
-    free_desc(i);
-    if(disk.desc[i].flags & VRING_DESC_F_NEXT)
-      i = disk.desc[i].next;
+    int flag = d->desc[i].flags;
+    int nxt = d->desc[i].next;
+    free_desc(d, i);
+    if(flag & VRING_DESC_F_NEXT)
+      i = nxt;
     else
       break;
   }
+  wakeup(&d->nfree);
 }
 
+// allocate n descriptors, if that many are free.
 static int
-alloc3_desc(int *idx)
+allocn_desc(struct disk *d, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
+  if(d->nfree < n)
+    return -1;
+  for(int i = 0; i < n; i++)
+    idx[i] = alloc_desc(d);
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+static void drain(struct disk *d);
+
+// allocate the descriptors for a request with n data segments,
+// sleeping until enough are free, and return the index of the
+// first.  the spec says that legacy block operations use a
+// descriptor for type/reserved/sector, then descriptors
+// for the data, then one for a 1-byte status result.
+// with indirect descriptors, the chain goes in the request's
+// table and takes just one descriptor in the ring.  either
+// way, desc[idx[i]] is set to the chain's i'th descriptor.
+// caller holds vdisk_lock.
+static int
+alloc_req(struct disk *d, int n, struct VRingDesc **desc, int *idx)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  int head, i;
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(d, idx, d->indirect ? 1 : n+2) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&d->nfree, &d->vdisk_lock);
+  }
+  head = idx[0];
+  if(d->indirect){
+    d->desc[head].addr = (uint64) d->indir[head];
+    d->desc[head].len = (n+2) * sizeof(struct VRingDesc);
+    d->desc[head].flags = VRING_DESC_F_INDIRECT;
+    d->desc[head].next = 0;
+    *desc = d->indir[head];
+    for(i = 0; i < n+2; i++)
+      idx[i] = i;
+  } else {
+    *desc = d->desc;
+  }
+  return head;
+}
+
+// give the device the request whose chain starts at head.
+// caller holds vdisk_lock.
+static void
+submit(struct disk *d, int head)
+{
+  // avail[0] is flags
+  // avail[1] tells the device how far to look in avail[2...].
+  // avail[2...] are desc[] indices the device should process.
+  // we only tell device the first index in our chain of descriptors.
+  uint16 old = d->avail[1];
+  d->avail[2 + (old % d->num)] = head;
+  __sync_synchronize();
+  d->avail[1] = old + 1;
+  __sync_synchronize();
+
+  // the device may still be working through the avail ring,
+  // in which case it will find this request without a notify.
+  // with EVENT_IDX it says how far it has looked in the avail
+  // event index, just past the used ring.
+  int notify;
+  if(d->eventidx)
+    notify = VRING_NEED_EVENT(*(volatile uint16 *)&d->used->elems[d->num],
+                              (uint16)(old + 1), old);
+  else
+    notify = (d->used->flags & VRING_USED_F_NO_NOTIFY) == 0;
+  if(notify){
+    d->nnotify++;
+    *R(d, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
   }
+}
+
+// start reading or writing b, and the bufs chained to it
+// through b->qnext, which hold the blocks following b's.
+// returns without waiting for the disk; when the
+// request finishes, virtio_disk_intr() passes the chain
+// to iodone().
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  struct disk *d = &disk[minor(b->dev)];
+  uint64 sector = (uint64)b->blockno * (bsize / 512);
+  struct buf *bb;
+  int n, i;
+
+  if(!virtio_disk_open(minor(b->dev)))
+    panic("virtio_disk_rw: no disk");
+  n = 0;
+  for(bb = b; bb; bb = bb->qnext)
+    n++;
+  if(n > MAXMERGE)
+    panic("virtio_disk_rw: too many blocks");
+
+  acquire(&d->vdisk_lock);
+
+  int idx[MAXMERGE+2];
+  struct VRingDesc *desc;
+  int head = alloc_req(d, n, &desc, idx);
   
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_req *buf0 = &d->ops[head];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  desc[idx[0]].addr = (uint64) buf0;
+  desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  desc[idx[0]].next = idx[1];
+
+  for(i = 1, bb = b; bb; i++, bb = bb->qnext){
+    desc[idx[i]].addr = (uint64) bb->data;
+    desc[idx[i]].len = bsize;
+    if(write)
+      desc[idx[i]].flags = 0; // device reads bb->data
+    else
+      desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes bb->data
+    desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    desc[idx[i]].next = idx[i+1];
+  }
 
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  d->info[head].status = 0;
+  desc[idx[n+1]].addr = (uint64) &d->info[head].status;
+  desc[idx[n+1]].len = 1;
+  desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  desc[idx[n+1]].next = 0;
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  d->info[head].b = b;
 
-  // avail[0] is flags
-  // avail[1] tells the device how far to look in avail[2...].
-  // avail[2...] are desc[] indices the device should process.
-  // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
-  __sync_synchronize();
-  disk.avail[1] = disk.avail[1] + 1;
+  submit(d, head);
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&d->vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// tell the disk in slot n that the nblocks blocks starting
+// at blockno no longer hold anything, so that it can give
+// back the space.  waits for the disk to finish.
+void
+virtio_disk_discard(int n, uint blockno, uint nblocks)
+{
+  struct disk *d = &disk[n];
+  int idx[3];
+  struct VRingDesc *desc;
+  uint cnt;
+
+  if(!virtio_disk_open(n))
+    panic("virtio_disk_discard: no disk");
+  // the file system's blocks may be bigger than the
+  // disk can discard at once.
+  if(!d->discard || d->maxdiscard < bsize / 512)
+    return;
+
+  acquire(&d->vdisk_lock);
+  while(nblocks > 0){
+    cnt = nblocks;
+    if(cnt > d->maxdiscard / (bsize / 512))
+      cnt = d->maxdiscard / (bsize / 512);
+
+    int head = alloc_req(d, 1, &desc, idx);
+
+    struct virtio_blk_req *buf0 = &d->ops[head];
+    buf0->type = VIRTIO_BLK_T_DISCARD;
+    buf0->reserved = 0;
+    buf0->sector = 0;
+    desc[idx[0]].addr = (uint64) buf0;
+    desc[idx[0]].len = sizeof(struct virtio_blk_req);
+    desc[idx[0]].flags = VRING_DESC_F_NEXT;
+    desc[idx[0]].next = idx[1];
+
+    struct virtio_blk_discard *seg = &d->seg[head];
+    seg->sector = (uint64)blockno * (bsize / 512);
+    seg->num_sectors = cnt * (bsize / 512);
+    seg->flags = 0;
+    desc[idx[1]].addr = (uint64) seg;
+    desc[idx[1]].len = sizeof(struct virtio_blk_discard);
+    desc[idx[1]].flags = VRING_DESC_F_NEXT; // device reads seg
+    desc[idx[1]].next = idx[2];
+
+    d->info[head].status = 0;
+    desc[idx[2]].addr = (uint64) &d->info[head].status;
+    desc[idx[2]].len = 1;
+    desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
+    desc[idx[2]].next = 0;
+
+    // no buf; drain() marks the request done.
+    d->info[head].b = 0;
+    d->info[head].done = 0;
+
+    submit(d, head);
+    while(d->info[head].done == 0)
+      sleep(&d->info[head], &d->vdisk_lock);
+
+    blockno += cnt;
+    nblocks -= cnt;
   }
+  release(&d->vdisk_lock);
+}
+
+void
+virtio_disk_intr(int n)
+{
+  struct disk *d = &disk[n];
+
+  if(!d->present)
+    return;
+
+  acquire(&d->vdisk_lock);
+
+  d->nintr++;
+
+  // tell the device we've seen this interrupt, before
+  // looking at the used ring, so that a completion that
+  // arrives while we look raises another one.
+  *R(d, VIRTIO_MMIO_INTERRUPT_ACK) = *R(d, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  drain(d);
 
-  release(&disk.vdisk_lock);
+  release(&d->vdisk_lock);
 }
 
+// look for completed requests on the disk in slot n
+// without waiting for an interrupt.  for bwaitpoll().
 void
-virtio_disk_intr()
+virtio_disk_poll(int n)
 {
-  acquire(&disk.vdisk_lock);
+  struct disk *d = &disk[n];
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  acquire(&d->vdisk_lock);
+  drain(d);
+  release(&d->vdisk_lock);
+}
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+// finish the requests the device has completed.
+// caller holds vdisk_lock.
+static void
+drain(struct disk *d)
+{
+  while(1){
+    // the device increments used->id as it completes requests;
+    // each one may be for any in-flight request.
+    while(d->used_idx != d->used->id){
+      __sync_synchronize();
+      int id = d->used->elems[d->used_idx % d->num].id;
+      struct buf *b = d->info[id].b;
+
+      if(b && d->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      d->info[id].b = 0;
+      free_chain(d, id);
+      if(b == 0){
+        // a discard; failure doesn't matter.
+        d->info[id].done = 1;
+        wakeup(&d->info[id]);
+      }
+      if(b)
+        iodone(b);   // disk is done with the bufs
+
+      d->used_idx += 1;
+    }
+    if(!d->eventidx)
+      break;
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+    // with EVENT_IDX the device interrupts only when used->id
+    // passes the used event index, at the end of the avail
+    // ring, so completions that arrive while we are here
+    // raise no more interrupts.  ask for one at the next
+    // completion, then look once more in case it came
+    // before the device saw the request.
+    d->avail[2 + d->num] = d->used_idx;
+    __sync_synchronize();
+    if(d->used_idx == d->used->id)
+      break;
   }
+}
 
-  release(&disk.vdisk_lock);
+// print notify and interrupt counts.  for ^P.
+void
+virtio_disk_dump(void)
+{
+  struct disk *d;
+
+  for(d = disk; d < &disk[NVIRTIO]; d++){
+    if(!d->present)
+      continue;
+    printf("virtio disk %d: queue %d%s%s%s, %d notifies, %d interrupts\n",
+           (int)(d - disk), d->num, d->indirect ? " indirect" : "",
+           d->eventidx ? " event_idx" : "", d->discard ? " discard" : "",
+           d->nnotify, d->nintr);
+  }
 }
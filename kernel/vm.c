@@ -30,7 +30,11 @@ kvminit()
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
   // virtio mmio disk interface
-  kvmmap(VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(VIRTIO0, VIRTIO0, NVIRTIO*PGSIZE, PTE_R | PTE_W);
+
+  // initrd image, for the ramdisk
+  if(ramdisksize() > 0)
+    kvmmap(ramdiskbase(), ramdiskbase(), ramdisksize(), PTE_R | PTE_W);
 
   // CLINT
   kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
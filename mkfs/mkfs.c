@@ -20,9 +20,14 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int bsize = MINBSIZE;  // -b
+int fskb = FSSIZE;     // -s; size of file system in KB
+int fssize;   // Size of file system in blocks of bsize
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGBLOCKS;  // -l
+int sbflags;           // -o sets SB_ORDERED, -w SB_WRITEBACK,
+                       // -e SB_EXTENT
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +45,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+int minlog(void);
 
 // convert to intel byte order
 ushort
@@ -64,11 +70,23 @@ xint(uint x)
   return y;
 }
 
+uint64
+xlong(uint64 x)
+{
+  uint64 y;
+  uchar *a = (uchar*)&y;
+  int i;
+
+  for(i = 0; i < 8; i++)
+    a[i] = x >> (8*i);
+  return y;
+}
+
 int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum, off, logstart;
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
@@ -76,13 +94,54 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for(;;){
+    if(argc > 3 && strcmp(argv[1], "-l") == 0){
+      nlog = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(argc > 3 && strcmp(argv[1], "-b") == 0){
+      bsize = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(argc > 3 && strcmp(argv[1], "-s") == 0){
+      fskb = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(argc > 2 && strcmp(argv[1], "-o") == 0){
+      sbflags |= SB_ORDERED;
+      argc--;
+      argv++;
+    } else if(argc > 2 && strcmp(argv[1], "-w") == 0){
+      sbflags |= SB_WRITEBACK;
+      argc--;
+      argv++;
+    } else if(argc > 2 && strcmp(argv[1], "-e") == 0){
+      sbflags |= SB_EXTENT;
+      argc--;
+      argv++;
+    } else
+      break;
+  }
+  if(argc < 2 || bsize < MINBSIZE || bsize > BSIZE ||
+     (bsize & (bsize - 1)) != 0 || fskb <= 0){
+    fprintf(stderr, "Usage: mkfs [-b bsize] [-s kbytes] [-l nlog] [-o] [-w] [-e] fs.img files...\n");
+    exit(1);
+  }
+  fssize = fskb / (bsize / 1024);
+  if(nlog < 2 || nlog >= fssize/2){
+    fprintf(stderr, "mkfs: a log of %d blocks doesn't fit in %d KB\n", nlog, fskb);
     exit(1);
   }
+  if(nlog < minlog()){
+    fprintf(stderr, "mkfs: a log of %d-byte blocks needs at least %d of them\n",
+            bsize, minlog());
+    exit(1);
+  }
+  nbitmap = fssize/(bsize*8) + 1;
+  ninodeblocks = NINODES / IPB(bsize) + 1;
 
-  assert((BSIZE % sizeof(struct dinode)) == 0);
-  assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert((bsize % sizeof(struct dinode)) == 0);
+  assert((bsize % sizeof(struct dirent)) == 0);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -90,30 +149,33 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  // the log starts in the block after the super block's.
+  logstart = SBOFF/bsize + 1;
+  nmeta = logstart + nlog + ninodeblocks + nbitmap;
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(logstart);
+  sb.inodestart = xint(logstart+nlog);
+  sb.bmapstart = xint(logstart+nlog+ninodeblocks);
+  sb.flags = xint(sbflags);
+  sb.bsize = xint(bsize);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  for(i = 0; i < fssize; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(buf + SBOFF % bsize, &sb, sizeof(sb));
+  wsect(SBOFF / bsize, buf);
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
@@ -165,9 +227,9 @@ main(int argc, char *argv[])
 
   // fix size of root inode dir
   rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
+  off = xlong(din.size);
+  off = ((off/bsize) + 1) * bsize;
+  din.size = xlong(off);
   winode(rootino, &din);
 
   balloc(freeblock);
@@ -178,11 +240,11 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, sec * bsize, 0) != sec * bsize){
     perror("lseek");
     exit(1);
   }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
+  if(write(fsfd, buf, bsize) != bsize){
     perror("write");
     exit(1);
   }
@@ -197,7 +259,7 @@ winode(uint inum, struct dinode *ip)
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
+  dip = ((struct dinode*)buf) + (inum % IPB(bsize));
   *dip = *ip;
   wsect(bn, buf);
 }
@@ -211,18 +273,18 @@ rinode(uint inum, struct dinode *ip)
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
+  dip = ((struct dinode*)buf) + (inum % IPB(bsize));
   *ip = *dip;
 }
 
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, sec * bsize, 0) != sec * bsize){
     perror("lseek");
     exit(1);
   }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
+  if(read(fsfd, buf, bsize) != bsize){
     perror("read");
     exit(1);
   }
@@ -235,9 +297,11 @@ ialloc(ushort type)
   struct dinode din;
 
   bzero(&din, sizeof(din));
-  din.type = xshort(type);
+  din.type = type;
+  if(sbflags & SB_EXTENT)
+    din.flags = I_EXTENT;
   din.nlink = xshort(1);
-  din.size = xint(0);
+  din.size = xlong(0);
   winode(inum, &din);
   return inum;
 }
@@ -246,19 +310,91 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used <= nbitmap*BPB(bsize));
+  for(b = 0; b*BPB(bsize) < used; b++){
+    bzero(buf, bsize);
+    for(i = 0; i < BPB(bsize) && b*BPB(bsize) + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// Map block fbn of extent-mapped inode din, which is its last
+// block or just past the end, allocating it if need be.  Files
+// are written one at a time, so most are a single run of
+// blocks; a directory that grows while files are added to it
+// may need more extents than the inode holds, and then gets
+// leaves below the root.  mkfs builds trees of depth 1 only,
+// which holds NIEXT*NBEXT(bsize) extents.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  struct exthdr *root = (struct exthdr*)din->addrs;
+  struct exthdr *h = root;
+  struct extent *e;
+  uint node[BSIZE/sizeof(uint)];
+  uint leaf = 0;
+  int n;
+
+  if(xshort(root->depth) > 0){
+    assert(xshort(root->depth) == 1);
+    e = (struct extent*)(root + 1);
+    leaf = xint(e[xshort(root->n) - 1].start);
+    rsect(leaf, node);
+    h = (struct exthdr*)node;
+  }
+  e = (struct extent*)(h + 1);
+  n = xshort(h->n);
+  if(n > 0 && fbn < xint(e[n-1].bn) + xint(e[n-1].len))
+    return xint(e[n-1].start) + fbn - xint(e[n-1].bn);
+  if(n > 0 && xint(e[n-1].start) + xint(e[n-1].len) == freeblock){
+    e[n-1].len = xint(xint(e[n-1].len) + 1);
+    goto out;
+  }
+
+  if(leaf == 0 && n == NIEXT){
+    // move the root's extents down into a leaf.
+    leaf = freeblock++;
+    bzero(node, sizeof(node));
+    memmove(node, root, sizeof(*root) + n*sizeof(struct extent));
+    h = (struct exthdr*)node;
+    e = (struct extent*)(root + 1);
+    e[0].start = xint(leaf);
+    e[0].len = xint(0);
+    root->n = xshort(1);
+    root->depth = xshort(1);
+  } else if(leaf != 0 && n == NBEXT(bsize)){
+    // start a new leaf.
+    assert(xshort(root->n) < NIEXT);
+    leaf = freeblock++;
+    e = (struct extent*)(root + 1) + xshort(root->n);
+    e->bn = xint(fbn);
+    e->start = xint(leaf);
+    e->len = xint(0);
+    root->n = xshort(xshort(root->n) + 1);
+    bzero(node, sizeof(node));
+    h = (struct exthdr*)node;
+    n = 0;
+  }
+  e = (struct extent*)(h + 1) + n;
+  e->bn = xint(fbn);
+  e->start = xint(freeblock);
+  e->len = xint(1);
+  h->n = xshort(n + 1);
+
+out:
+  if(leaf)
+    wsect(leaf, node);
+  return freeblock++;
+}
 
 void
 iappend(uint inum, void *xp, int n)
@@ -267,39 +403,70 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
-  uint x;
+  uint indirect[NINDIRECT(BSIZE)];
+  uint x, bn, span;
+  int i, levels;
 
   rinode(inum, &din);
-  off = xint(din.size);
+  off = xlong(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
-    fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    fbn = off / bsize;
+    if(din.flags & I_EXTENT){
+      x = emap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      // through levels of indirect blocks from addrs[i].
+      bn = fbn - NDIRECT;
+      i = NDIRECT;
+      levels = 1;
+      span = 1;
+      while(bn >= span * NINDIRECT(bsize)){
+        bn -= span * NINDIRECT(bsize);
+        span *= NINDIRECT(bsize);
+        i++;
+        levels++;
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      assert(i < NADDRS);
+      if(xint(din.addrs[i]) == 0){
+        din.addrs[i] = xint(freeblock++);
+      }
+      x = xint(din.addrs[i]);
+      for(; levels > 0; levels--){
+        rsect(x, (char*)indirect);
+        if(indirect[bn / span] == 0){
+          indirect[bn / span] = xint(freeblock++);
+          wsect(x, (char*)indirect);
+        }
+        x = xint(indirect[bn / span]);
+        bn %= span;
+        span /= NINDIRECT(bsize);
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
-    n1 = min(n, (fbn + 1) * BSIZE - off);
+    n1 = min(n, (fbn + 1) * bsize - off);
     rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
+    bcopy(p, buf + off - (fbn * bsize), n1);
     wsect(x, buf);
     n -= n1;
     off += n1;
     p += n1;
   }
-  din.size = xint(off);
+  din.size = xlong(off);
   winode(inum, &din);
 }
+
+// The smallest log initlog() accepts: the log super block, and
+// room for two transactions (one committing, one running) of
+// MAXOPBLOCKS blocks, or of a one-block write() if that needs
+// more.
+int
+minlog(void)
+{
+  int n = max(MAXOPBLOCKS, WRITEBLOCKS(1));
+
+  return 1 + 2*TRANSBLOCKS(n, bsize);
+}
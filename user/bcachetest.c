@@ -0,0 +1,90 @@
+// Concurrent-read benchmark for the buffer cache.
+//
+// Each child repeatedly reads its own small file, which stays
+// cached, so the run time is dominated by buffer cache lookups.
+// With per-bucket locks the elapsed time should stay roughly
+// flat as the number of children grows (up to the number of CPUs).
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define MAXCHILD 4
+#define NBLOCK   8    // blocks per file
+#define ROUNDS   500
+
+char buf[BSIZE];
+
+void
+createfile(char *path)
+{
+  int fd, i;
+
+  fd = open(path, O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("bcachetest: cannot create %s\n", path);
+    exit(1);
+  }
+  memset(buf, 'a', sizeof(buf));
+  for(i = 0; i < NBLOCK; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bcachetest: write %s failed\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+readfile(char *path)
+{
+  int fd, i;
+
+  for(i = 0; i < ROUNDS; i++){
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+      printf("bcachetest: cannot open %s\n", path);
+      exit(1);
+    }
+    while(read(fd, buf, sizeof(buf)) > 0)
+      ;
+    close(fd);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, start;
+  char path[] = "bcache0";
+
+  printf("bcachetest starting\n");
+
+  for(i = 0; i < MAXCHILD; i++){
+    path[6] = '0' + i;
+    createfile(path);
+  }
+
+  for(n = 1; n <= MAXCHILD; n *= 2){
+    start = uptime();
+    for(i = 0; i < n; i++){
+      if(fork() == 0){
+        path[6] = '0' + i;
+        readfile(path);
+        exit(0);
+      }
+    }
+    for(i = 0; i < n; i++)
+      wait(0);
+    printf("%d readers: %d ticks\n", n, uptime() - start);
+  }
+
+  for(i = 0; i < MAXCHILD; i++){
+    path[6] = '0' + i;
+    unlink(path);
+  }
+
+  exit(0);
+}
@@ -0,0 +1,82 @@
+// Sequential throughput benchmark for big files.
+//
+// Writes a file of the given number of megabytes (default 4),
+// fsyncs it, then reads it back and checks it.  Files past
+// (NDIRECT + NINDIRECT) blocks go through doubly indirect
+// blocks, and past NDINDIRECT more through triply indirect
+// ones (e.g. "bigfile 70" with 1KB blocks).  The default
+// fs.img is only FSSIZE KB; make a bigger one for big files,
+// e.g. with MKFSFLAGS="-s 100000".
+//
+// To compare block sizes, run it on file systems made with
+// MKFSFLAGS="-b 1024", "-b 2048" and "-b 4096".
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define CHUNK 16   // blocks per read() or write()
+
+char buf[CHUNK*BSIZE];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, j, mb, nchunk, start, t;
+
+  mb = 4;
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(mb <= 0){
+    fprintf(2, "usage: bigfile [megabytes]\n");
+    exit(1);
+  }
+  nchunk = mb * (1024*1024 / sizeof(buf));
+
+  printf("bigfile: %d MB\n", mb);
+  fd = open("bigfile.dat", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("bigfile: cannot create bigfile.dat\n");
+    exit(1);
+  }
+  start = uptime();
+  for(i = 0; i < nchunk; i++){
+    for(j = 0; j < CHUNK; j++)
+      ((int*)buf)[j*BSIZE/sizeof(int)] = i*CHUNK + j;
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bigfile: write failed at block %d\n", i*CHUNK);
+      exit(1);
+    }
+  }
+  fsync(fd);
+  close(fd);
+  t = uptime() - start;
+  printf("write: %d ticks\n", t);
+
+  fd = open("bigfile.dat", O_RDONLY);
+  if(fd < 0){
+    printf("bigfile: cannot open bigfile.dat\n");
+    exit(1);
+  }
+  start = uptime();
+  for(i = 0; i < nchunk; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bigfile: read failed at block %d\n", i*CHUNK);
+      exit(1);
+    }
+    for(j = 0; j < CHUNK; j++){
+      if(((int*)buf)[j*BSIZE/sizeof(int)] != i*CHUNK + j){
+        printf("bigfile: block %d has wrong contents\n", i*CHUNK + j);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  t = uptime() - start;
+  printf("read: %d ticks\n", t);
+
+  unlink("bigfile.dat");
+  exit(0);
+}
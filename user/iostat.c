@@ -0,0 +1,85 @@
+// Report block I/O statistics.
+//
+// iostat [-h] [interval [count]] prints, every interval ticks,
+// the requests, blocks and merges per device since the last
+// report, the requests in flight and how busy the device was.
+// The first report covers the time since boot.  With -h it
+// prints the latency histograms instead, and exits.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/iostat.h"
+#include "user/user.h"
+
+#define MAXDEV     8
+#define TICKUSEC   100000   // usec per clock tick
+
+struct iostat old[MAXDEV], cur[MAXDEV];
+
+void
+histograms(void)
+{
+  struct iostat *st;
+  int i, d;
+
+  for(d = 0; d < MAXDEV && iostat(d, &cur[d]) == 0; d++){
+    st = &cur[d];
+    printf("dev %d,%d latency usec: read write\n", st->dev >> 16, st->dev & 0xFFFF);
+    for(i = 0; i < NIOLAT; i++){
+      if(st->lat[0][i] || st->lat[1][i])
+        printf("  <%d: %d %d\n", 2 << i, st->lat[0][i], st->lat[1][i]);
+    }
+  }
+}
+
+void
+report(int ticks)
+{
+  struct iostat *st, *o;
+  int d;
+
+  printf("dev rreq wreq rblk wblk rmrg wmrg infl util%%\n");
+  for(d = 0; d < MAXDEV && iostat(d, &cur[d]) == 0; d++){
+    st = &cur[d];
+    o = &old[d];
+    printf("%d,%d  %d %d %d %d %d %d %d %d\n",
+           st->dev >> 16, st->dev & 0xFFFF,
+           (int)(st->nreq[0] - o->nreq[0]), (int)(st->nreq[1] - o->nreq[1]),
+           (int)(st->nblock[0] - o->nblock[0]), (int)(st->nblock[1] - o->nblock[1]),
+           (int)(st->nmerge[0] - o->nmerge[0]), (int)(st->nmerge[1] - o->nmerge[1]),
+           st->inflight,
+           ticks > 0 ? (int)((st->busy - o->busy) * 100 / ((uint64)ticks * TICKUSEC)) : 0);
+    *o = *st;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int interval = 0, count = 1, i, t, last;
+
+  if(argc > 1 && strcmp(argv[1], "-h") == 0){
+    histograms();
+    exit(0);
+  }
+  if(argc > 1){
+    interval = atoi(argv[1]);
+    count = 0;  // forever
+  }
+  if(argc > 2)
+    count = atoi(argv[2]);
+  if(argc > 3 || (argc > 1 && interval <= 0)){
+    fprintf(2, "Usage: iostat [-h] [interval [count]]\n");
+    exit(1);
+  }
+
+  last = uptime();
+  report(last);
+  for(i = 1; count == 0 || i < count; i++){
+    sleep(interval);
+    t = uptime();
+    report(t - last);
+    last = t;
+  }
+  exit(0);
+}
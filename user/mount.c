@@ -0,0 +1,32 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+int
+main(int argc, char *argv[])
+{
+  int flags = 0;
+
+  while(argc > 4 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-d") == 0)
+      flags |= MNT_DISCARD;
+    else if(strcmp(argv[1], "-o") == 0)
+      flags |= MNT_ORDERED;
+    else
+      break;
+    argc--;
+    argv++;
+  }
+  if(argc != 4){
+    fprintf(2, "Usage: mount [-d] [-o] major minor dir\n");
+    exit(1);
+  }
+
+  if(mount(atoi(argv[1]), atoi(argv[2]), argv[3], flags) < 0){
+    fprintf(2, "mount: cannot mount %s %s on %s\n", argv[1], argv[2], argv[3]);
+    exit(1);
+  }
+
+  exit(0);
+}
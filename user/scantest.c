@@ -0,0 +1,129 @@
+// Scan-resistance benchmark for the buffer cache.
+//
+// Interleaves sequential scans of a big file with metadata-heavy
+// work on a directory of small files (open, fstat, read, close).
+// With LRU replacement every scan flushes the inode, bitmap and
+// directory blocks, so the metadata work goes back to the disk;
+// with 2Q they stay cached.  The difference only shows once the
+// scan is larger than the buffer cache, so the big file is half
+// as big again as bcachesize() says the cache can grow to.  That
+// needs a bigger fs.img than the default, e.g. one made with
+// MKFSFLAGS="-s 100000".
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define NSMALL     40
+#define ROUNDS     10
+
+char buf[BSIZE];
+char name[] = "scandir/f00";
+int scanblocks;  // of BSIZE bytes
+
+void
+mkfiles(void)
+{
+  int fd, i;
+
+  if(mkdir("scandir") < 0){
+    printf("scantest: mkdir failed\n");
+    exit(1);
+  }
+  for(i = 0; i < NSMALL; i++){
+    name[9] = '0' + i/10;
+    name[10] = '0' + i%10;
+    fd = open(name, O_CREATE | O_RDWR);
+    if(fd < 0 || write(fd, name, sizeof(name)) != sizeof(name)){
+      printf("scantest: cannot create %s\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  fd = open("scanfile", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("scantest: cannot create scanfile\n");
+    exit(1);
+  }
+  memset(buf, 's', sizeof(buf));
+  for(i = 0; i < scanblocks; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("scantest: write scanfile failed; is fs.img big enough for %d KB?\n",
+             scanblocks * (BSIZE / 1024));
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+scan(void)
+{
+  int fd;
+
+  fd = open("scanfile", O_RDONLY);
+  while(read(fd, buf, sizeof(buf)) > 0)
+    ;
+  close(fd);
+}
+
+void
+metadata(void)
+{
+  struct stat st;
+  int fd, i;
+
+  for(i = 0; i < NSMALL; i++){
+    name[9] = '0' + i/10;
+    name[10] = '0' + i%10;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("scantest: cannot open %s\n", name);
+      exit(1);
+    }
+    fstat(fd, &st);
+    read(fd, buf, sizeof(buf));
+    close(fd);
+  }
+}
+
+void
+rmfiles(void)
+{
+  int i;
+
+  for(i = 0; i < NSMALL; i++){
+    name[9] = '0' + i/10;
+    name[10] = '0' + i%10;
+    unlink(name);
+  }
+  unlink("scandir");
+  unlink("scanfile");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, start, t, meta, total;
+
+  scanblocks = bcachesize() / BSIZE * 3 / 2;
+  printf("scantest starting: scanning %d KB\n", scanblocks * (BSIZE / 1024));
+  mkfiles();
+
+  meta = 0;
+  start = uptime();
+  for(i = 0; i < ROUNDS; i++){
+    scan();
+    t = uptime();
+    metadata();
+    meta += uptime() - t;
+  }
+  total = uptime() - start;
+  printf("%d rounds: %d ticks total, %d ticks in metadata\n",
+         ROUNDS, total, meta);
+
+  rmfiles();
+  exit(0);
+}
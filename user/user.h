@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct iostat;
 
 // system calls
 int fork(void);
@@ -23,6 +24,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int mount(int, int, const char*, int);
+int iostat(int, struct iostat*);
+int fsync(int);
+int fdatasync(int);
+int sync(void);
+int bcachesize(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
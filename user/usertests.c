@@ -18,6 +18,9 @@
 //
 
 #define BUFSZ  (MAXOPBLOCKS+2)*BSIZE
+// writes of BSIZE, the largest block size, that reach
+// the doubly indirect blocks with any block size.
+#define BIGBLOCKS (NDIRECT + NINDIRECT(BSIZE) + 64)
 
 char buf[BUFSZ];
 char name[3];
@@ -188,7 +191,8 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  // reach into the doubly indirect blocks.
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", i);
@@ -208,7 +212,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == BIGBLOCKS - 1){
         printf("%s: read only %d blocks from big", n);
         exit(1);
       }
@@ -2087,6 +2091,358 @@ badarg(char *s)
   exit(0);
 }
 
+// with mkfs -o, file data goes straight home, not through the
+// log, while blocks freed by one file are reused by others.
+// check that concurrent writes, overwrites and unlinks of
+// files whose blocks keep changing hands read back right.
+void
+ordered(char *s)
+{
+  enum { NCHILD=4, N=10, NB=20 };
+  int pid, ci, i, j, pass, fd, xstatus;
+  char file[] = "ord0";
+  char c;
+
+  for(ci = 0; ci < NCHILD; ci++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      file[3] = '0' + ci;
+      for(i = 0; i < N; i++){
+        // write the file, then overwrite every block of it.
+        for(pass = 0; pass < 2; pass++){
+          fd = open(file, pass == 0 ? O_CREATE|O_RDWR : O_RDWR);
+          if(fd < 0){
+            printf("%s: open %s failed\n", s, file);
+            exit(1);
+          }
+          c = 'a' + (ci*N + i*2 + pass) % 26;
+          for(j = 0; j < NB; j++){
+            memset(buf, c, BSIZE);
+            ((int*)buf)[0] = j;
+            if(write(fd, buf, BSIZE) != BSIZE){
+              printf("%s: write %s failed\n", s, file);
+              exit(1);
+            }
+          }
+          close(fd);
+        }
+
+        fd = open(file, O_RDONLY);
+        if(fd < 0){
+          printf("%s: open %s failed\n", s, file);
+          exit(1);
+        }
+        for(j = 0; j < NB; j++){
+          if(read(fd, buf, BSIZE) != BSIZE){
+            printf("%s: read %s failed\n", s, file);
+            exit(1);
+          }
+          if(((int*)buf)[0] != j || buf[BSIZE/2] != c || buf[BSIZE-1] != c){
+            printf("%s: %s block %d has wrong data\n", s, file, j);
+            exit(1);
+          }
+        }
+        if(read(fd, buf, 1) != 0){
+          printf("%s: %s too long\n", s, file);
+          exit(1);
+        }
+        close(fd);
+        if(unlink(file) < 0){
+          printf("%s: unlink %s failed\n", s, file);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+
+  for(ci = 0; ci < NCHILD; ci++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+}
+
+// fsync(), fdatasync() and sync() succeed on files and
+// directories, fail on pipes and bad descriptors, and what
+// they make durable reads back (with mkfs -w, FS calls
+// return before their transactions commit).
+void
+fsynctest(char *s)
+{
+  enum { N=12 };
+  int fd, i, fds[2];
+
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsyncf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write fsyncf failed\n", s);
+      exit(1);
+    }
+    if((i%3 == 0 && fsync(fd) != 0) ||
+       (i%3 == 1 && fdatasync(fd) != 0) ||
+       (i%3 == 2 && sync() != 0)){
+      printf("%s: sync %d of fsyncf failed\n", s, i%3);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(fsync(fd) >= 0 || fdatasync(fd) >= 0){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("fsyncf", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open fsyncf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read fsyncf failed\n", s);
+      exit(1);
+    }
+    if(buf[0] != 'a' + i || buf[BSIZE-1] != 'a' + i){
+      printf("%s: fsyncf block %d has wrong data\n", s, i);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, 1) != 0){
+    printf("%s: fsyncf too long\n", s);
+    exit(1);
+  }
+  if(fdatasync(fd) != 0){
+    printf("%s: fdatasync of a read-only fd failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(unlink("fsyncf") < 0){
+    printf("%s: unlink fsyncf failed\n", s);
+    exit(1);
+  }
+  fd = open(".", O_RDONLY);
+  if(fd < 0 || fsync(fd) != 0){
+    printf("%s: fsync of . failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(open("fsyncf", O_RDONLY) >= 0){
+    printf("%s: fsyncf still there\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) >= 0 || fdatasync(fds[1]) >= 0){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// write and delete files that add up to twice the default disk
+// size, FSSIZE: balloc() panics if the blocks they free don't
+// all become free to allocate again.  the
+// two files of each round are written in turn and one deleted
+// before the other, leaving holes for the next round.
+void
+freereuse(char *s)
+{
+  enum { ROUNDS=6, NB=FSSIZE/6*1024/BSIZE };
+  int r, i, f, fd[2];
+  char file[] = "freea";
+
+  for(r = 0; r < ROUNDS; r++){
+    for(f = 0; f < 2; f++){
+      file[4] = 'a' + f;
+      fd[f] = open(file, O_CREATE|O_RDWR);
+      if(fd[f] < 0){
+        printf("%s: create %s failed\n", s, file);
+        exit(1);
+      }
+    }
+    for(i = 0; i < NB; i++){
+      for(f = 0; f < 2; f++){
+        ((int*)buf)[0] = i;
+        ((int*)buf)[1] = r*2 + f;
+        if(write(fd[f], buf, BSIZE) != BSIZE){
+          printf("%s: write round %d failed\n", s, r);
+          exit(1);
+        }
+      }
+    }
+    close(fd[0]);
+    close(fd[1]);
+
+    if(unlink("freea") < 0){
+      printf("%s: unlink freea failed\n", s);
+      exit(1);
+    }
+    fd[1] = open("freeb", O_RDONLY);
+    if(fd[1] < 0){
+      printf("%s: open freeb failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < NB; i++){
+      if(read(fd[1], buf, BSIZE) != BSIZE){
+        printf("%s: read freeb failed\n", s);
+        exit(1);
+      }
+      if(((int*)buf)[0] != i || ((int*)buf)[1] != r*2 + 1){
+        printf("%s: freeb block %d has wrong data\n", s, i);
+        exit(1);
+      }
+    }
+    close(fd[1]);
+    if(unlink("freeb") < 0){
+      printf("%s: unlink freeb failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// two files grown a block at a time in turn end up in many
+// pieces; with mkfs -e, in many extents and a tree of them below
+// the inode.  check both read back after growing one through a
+// new fd, that deleting it leaves the other alone, and that a
+// new file of the same name reads back only its own data.
+void
+extentfile(char *s)
+{
+  enum { NB=200 };
+  int i, f, n, fd[2];
+  char file[] = "exta";
+
+  for(f = 0; f < 2; f++){
+    file[3] = 'a' + f;
+    fd[f] = open(file, O_CREATE|O_RDWR);
+    if(fd[f] < 0){
+      printf("%s: create %s failed\n", s, file);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NB; i++){
+    for(f = 0; f < 2; f++){
+      memset(buf, 'a' + f, BSIZE);
+      ((int*)buf)[0] = i;
+      if(write(fd[f], buf, BSIZE) != BSIZE){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fd[0]);
+  close(fd[1]);
+
+  // grow exta: read to its end, then write on.
+  fd[0] = open("exta", O_RDWR);
+  if(fd[0] < 0){
+    printf("%s: open exta failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NB; i++){
+    if(read(fd[0], buf, BSIZE) != BSIZE){
+      printf("%s: read exta failed\n", s);
+      exit(1);
+    }
+  }
+  for(; i < 2*NB; i++){
+    memset(buf, 'a', BSIZE);
+    ((int*)buf)[0] = i;
+    if(write(fd[0], buf, BSIZE) != BSIZE){
+      printf("%s: grow exta failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd[0]);
+
+  for(f = 0; f < 2; f++){
+    file[3] = 'a' + f;
+    n = f == 0 ? 2*NB : NB;
+    fd[f] = open(file, O_RDONLY);
+    if(fd[f] < 0){
+      printf("%s: open %s failed\n", s, file);
+      exit(1);
+    }
+    for(i = 0; i < n; i++){
+      if(read(fd[f], buf, BSIZE) != BSIZE){
+        printf("%s: read %s failed\n", s, file);
+        exit(1);
+      }
+      if(((int*)buf)[0] != i || buf[BSIZE-1] != 'a' + f){
+        printf("%s: %s block %d has wrong data\n", s, file, i);
+        exit(1);
+      }
+    }
+    if(read(fd[f], buf, 1) != 0){
+      printf("%s: %s too long\n", s, file);
+      exit(1);
+    }
+    close(fd[f]);
+  }
+
+  if(unlink("exta") < 0){
+    printf("%s: unlink exta failed\n", s);
+    exit(1);
+  }
+  fd[0] = open("exta", O_CREATE|O_RDWR);
+  if(fd[0] < 0){
+    printf("%s: create exta again failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NB/2; i++){
+    memset(buf, 'c', BSIZE);
+    ((int*)buf)[0] = i;
+    if(write(fd[0], buf, BSIZE) != BSIZE){
+      printf("%s: write exta again failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd[0]);
+
+  fd[0] = open("exta", O_RDONLY);
+  fd[1] = open("extb", O_RDONLY);
+  if(fd[0] < 0 || fd[1] < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NB; i++){
+    for(f = 0; f < 2; f++){
+      if(f == 0 && i >= NB/2)
+        continue;
+      if(read(fd[f], buf, BSIZE) != BSIZE){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+      if(((int*)buf)[0] != i || buf[BSIZE-1] != (f == 0 ? 'c' : 'b')){
+        printf("%s: ext%c block %d has wrong data\n", s, 'a' + f, i);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd[0], buf, 1) != 0 || read(fd[1], buf, 1) != 0){
+    printf("%s: file too long\n", s);
+    exit(1);
+  }
+  close(fd[0]);
+  close(fd[1]);
+  unlink("exta");
+  unlink("extb");
+}
+
 // run each test in its own process. run returns 1 if child's exit()
 // indicates success.
 int
@@ -2170,6 +2526,10 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {ordered, "ordered"},
+    {fsynctest, "fsync"},
+    {freereuse, "freereuse"},
+    {extentfile, "extentfile"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -36,3 +36,9 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mount");
+entry("iostat");
+entry("fsync");
+entry("fdatasync");
+entry("sync");
+entry("bcachesize");